@@ -3,11 +3,16 @@
 
 #include "MEM_guardedalloc.h"
 
+#include "atomic_ops.h"
+
 #include "lib_ghash.h"
 #include "lib_list.h"
-#include "lib_mempool.h"
+#include "lib_math_base.h"
+#include "lib_task.h"
 #include "lib_utildefines.h"
 
+#include "CLG_log.h"
+
 #include "types_id.h"
 
 #include "tray_idtype.h"
@@ -20,181 +25,502 @@
 /** main_idmap API
  *
  * Cache Id (name, lib lookups).
- * This doesn't account for adding/removing data-blocks,
- * and should only be used when performing many lookups.
+ * The map is maintained incrementally: as long as adding, removing and renaming data-blocks is
+ * reported through main_idmap_insert_id, main_idmap_remove_id and main_idmap_rename_id, the name,
+ * uuid and valid ptrs mappings stay consistent and never need to be re-created.
  *
- * GHash's are initialized on demand,
+ * Type maps are initialized on demand,
  * since its likely some types will never have lookups run on them,
- * so its a waste to create and never use. */
+ * so its a waste to create and never use.
+ *
+ * Each type map is an open-addressing (linear probing) table, directly indexed by the
+ * `INDEX_ID_` of its type. Slots store the hash of their (name, lib) key next to it, so a lookup
+ * is a type index, one hash computation and (typically) one probe, only the final match needs a
+ * string comparison.
+ *
+ * The session uuid mapping and the valid Id ptrs set are flat tables of Id ptrs as well. They are
+ * both filled when creating the map, which for undo steps of big files means walking millions of
+ * Ids, so they are built in parallel: Ids are gathered in an array first, then inserted from
+ * several threads, each slot being claimed with an atomic compare-and-swap. */
+
+/* Marks a slot whose Id has been removed, probing must continue past it. */
+#define IDMAP_SLOT_REMOVED ((Id *)(uintptr_t)1)
+#define IDMAP_SLOT_IS_USED(_slot) ((_slot)->id > IDMAP_SLOT_REMOVED)
+
+/* Minimal amount of slots of a type map, must be a power of two. */
+#define IDMAP_SLOTS_MIN 16
+
+/* Check the whole map against its Main after each edit, very slow. */
+// #define USE_IDMAP_DEBUG_VALIDATE
+
+#ifdef USE_IDMAP_DEBUG_VALIDATE
+#  define IDMAP_DEBUG_VALIDATE(_id_map) lib_assert(main_idmap_validate(_id_map))
+#else
+#  define IDMAP_DEBUG_VALIDATE(_id_map) ((void)0)
+#endif
+
+static CLG_LogRef LOG = {"tray.idmap"};
+
+/* Below that amount of Ids, building the uuid and valid ptrs tables is done on a single thread. */
+#define IDMAP_PARALLEL_IDS_MIN 10000
 
-struct IdNameLib_Key {
-  /* `Id.name + 2`: without the Id type prefix, since each id type gets its own 'map'. */
-  const char *name;
-  /* `Id.lib`: */
+typedef struct IdNameLibSlot {
+  /* Hash of the (`Id.name + 2`, `Id.lib`) key. */
+  uint hash;
+  /* `Id.lib`, stored here to avoid accessing the Id for most non-matching slots. */
   const Lib *lib;
-};
+  /* NULL for empty slots, IDMAP_SLOT_REMOVED for removed ones. */
+  Id *id;
+} IdNameLibSlot;
 
 struct IdNameLibTypeMap {
-  GHash *map;
-  short id_type;
+  /* NULL until the type map is lazily created. */
+  IdNameLibSlot *slots;
+  uint slots_mask;
+  /* Amount of slots storing an Id. */
+  uint used_num;
+  /* Amount of slots marked as removed. */
+  uint removed_num;
 };
 
+/* Open-addressing set of Id ptrs, hashed either by ptr or by session uuid. */
+typedef struct IdPtrTable {
+  /* NULL when the table is not used. Slots are NULL when empty, IDMAP_SLOT_REMOVED when
+   * removed. */
+  Id **slots;
+  uint slots_mask;
+  uint used_num;
+  uint removed_num;
+  /* Hash Ids by their session uuid instead of their address. */
+  bool use_uuid;
+} IdPtrTable;
+
 /* Opaque structure, external API users only see this. */
 struct IdNameLibMap {
-  struct IdNameLib_TypeMap type_maps[INDEX_ID_MAX];
-  struct GHash *uuid_map;
+  struct IdNameLibTypeMap type_maps[INDEX_ID_MAX];
+  IdPtrTable uuid_map;
   struct Main *main;
-  struct GSet *valid_id_ptrs;
+  IdPtrTable valid_id_ptrs;
   int idmap_types;
-
-  /* For storage of keys for the TypeMap ghash, avoids many single allocs. */
-  lib_mempool *type_maps_keys_pool;
 };
 
 static struct IdNameLibTypeMap *main_idmap_from_idcode(struct IdNameLibMap *id_map,
-                                                        short id_type)
+                                                       const short id_type)
 {
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) {
-    for (int i = 0; i < INDEX_ID_MAX; i++) {
-      if (id_map->type_maps[i].id_type == id_type) {
-        return &id_map->type_maps[i];
+    const int index = idtype_idcode_to_index(id_type);
+    if (LIKELY(index >= 0)) {
+      return &id_map->type_maps[index];
+    }
+  }
+  return NULL;
+}
+
+static uint idmap_name_hash(const char *name, const Lib *lib)
+{
+  uint hash = lib_ghashutil_strhash_p_murmur(name);
+  if (lib) {
+    hash = (uint)lib_ghashutil_combine_hash(hash, lib_ghashutil_ptrhash(lib));
+  }
+  return hash;
+}
+
+static void idmap_type_map_slots_alloc(struct IdNameLibTypeMap *type_map, uint slots_num)
+{
+  lib_assert(is_power_of_2_i((int)slots_num));
+  type_map->slots = mem_callocn(sizeof(*type_map->slots) * slots_num, __func__);
+  type_map->slots_mask = slots_num - 1;
+  type_map->used_num = 0;
+  type_map->removed_num = 0;
+}
+
+/* Add an Id to the type map, assuming there is enough room for it. */
+static void idmap_type_map_slot_add(struct IdNameLibTypeMap *type_map, const uint hash, Id *id)
+{
+  for (uint i = hash & type_map->slots_mask;; i = (i + 1) & type_map->slots_mask) {
+    IdNameLibSlot *slot = &type_map->slots[i];
+    if (!IDMAP_SLOT_IS_USED(slot)) {
+      if (slot->id == IDMAP_SLOT_REMOVED) {
+        type_map->removed_num--;
+      }
+      slot->hash = hash;
+      slot->lib = id->lib;
+      slot->id = id;
+      type_map->used_num++;
+      return;
+    }
+  }
+}
+
+/* Keep the load factor (including removed slots) at or below one half. */
+static void idmap_type_map_ensure_room(struct IdNameLibTypeMap *type_map)
+{
+  const uint slots_num = type_map->slots_mask + 1;
+  if ((type_map->used_num + type_map->removed_num + 1) * 2 <= slots_num) {
+    return;
+  }
+
+  IdNameLibSlot *old_slots = type_map->slots;
+  const uint new_slots_num = MAX2((uint)IDMAP_SLOTS_MIN,
+                                  power_of_2_max_u((type_map->used_num + 1) * 4));
+  idmap_type_map_slots_alloc(type_map, new_slots_num);
+
+  for (uint i = 0; i < slots_num; i++) {
+    if (IDMAP_SLOT_IS_USED(&old_slots[i])) {
+      idmap_type_map_slot_add(type_map, old_slots[i].hash, old_slots[i].id);
+    }
+  }
+  mem_freen(old_slots);
+}
+
+/* Find the slot storing `id`, starting from the probing position of given `hash`. */
+static IdNameLibSlot *idmap_type_map_slot_find_id(struct IdNameLibTypeMap *type_map,
+                                                  const uint hash,
+                                                  const Id *id)
+{
+  for (uint i = hash & type_map->slots_mask; type_map->slots[i].id != NULL;
+       i = (i + 1) & type_map->slots_mask)
+  {
+    if (type_map->slots[i].id == id) {
+      return &type_map->slots[i];
+    }
+  }
+  return NULL;
+}
+
+static void idmap_type_map_slot_remove(struct IdNameLibTypeMap *type_map, IdNameLibSlot *slot)
+{
+  slot->id = IDMAP_SLOT_REMOVED;
+  type_map->used_num--;
+  type_map->removed_num++;
+}
+
+static void idmap_type_map_build(struct IdNameLibMap *id_map,
+                                 struct IdNameLibTypeMap *type_map,
+                                 const short id_type)
+{
+  List *lb = which_lib(id_map->main, id_type);
+  const uint ids_num = (uint)lib_list_count(lb);
+
+  idmap_type_map_slots_alloc(type_map,
+                             MAX2((uint)IDMAP_SLOTS_MIN, power_of_2_max_u(ids_num * 2 + 1)));
+  LIST_FOREACH (Id *, id, lb) {
+    idmap_type_map_slot_add(type_map, idmap_name_hash(id->name + 2, id->lib), id);
+  }
+}
+
+static void idmap_type_map_free(struct IdNameLibTypeMap *type_map)
+{
+  MEM_SAFE_FREE(type_map->slots);
+  type_map->slots_mask = 0;
+  type_map->used_num = 0;
+  type_map->removed_num = 0;
+}
+
+/* -------------------------------------------------------------------- */
+/* Id Ptr Tables */
+
+LIB_INLINE uint idptr_table_hash_uuid(const uint session_uuid)
+{
+  return lib_ghashutil_uinthash(session_uuid);
+}
+
+LIB_INLINE uint idptr_table_hash(const IdPtrTable *table, const Id *id)
+{
+  return table->use_uuid ? idptr_table_hash_uuid(id->session_uuid) : lib_ghashutil_ptrhash(id);
+}
+
+static void idptr_table_alloc(IdPtrTable *table, const uint ids_num, const bool use_uuid)
+{
+  const uint slots_num = MAX2((uint)IDMAP_SLOTS_MIN, power_of_2_max_u(ids_num * 2 + 1));
+  table->slots = mem_callocn(sizeof(*table->slots) * slots_num, __func__);
+  table->slots_mask = slots_num - 1;
+  table->used_num = 0;
+  table->removed_num = 0;
+  table->use_uuid = use_uuid;
+}
+
+/* Add an Id to the table, assuming there is enough room for it.
+ * Safe to call from multiple threads, as long as no Id is removed meanwhile: slots are read with
+ * atomic loads and claimed with atomic_cas_ptr. */
+static void idptr_table_add(IdPtrTable *table, Id *id)
+{
+  for (uint i = idptr_table_hash(table, id) & table->slots_mask;; i = (i + 1) & table->slots_mask)
+  {
+    Id *slot_id = atomic_load_ptr((void *const *)&table->slots[i]);
+    if (slot_id == NULL || slot_id == IDMAP_SLOT_REMOVED) {
+      if (atomic_cas_ptr((void **)&table->slots[i], slot_id, id) != slot_id) {
+        /* Another thread claimed this slot first, check it again. */
+        i = (i - 1) & table->slots_mask;
+        continue;
+      }
+      if (slot_id == IDMAP_SLOT_REMOVED) {
+        atomic_sub_and_fetch_u(&table->removed_num, 1);
       }
+      atomic_add_and_fetch_u(&table->used_num, 1);
+      return;
+    }
+    if (slot_id == id) {
+      /* Already in the set. */
+      return;
+    }
+    lib_assert(!table->use_uuid || slot_id->session_uuid != id->session_uuid);
+  }
+}
+
+static void idptr_table_ensure_room(IdPtrTable *table)
+{
+  const uint slots_num = table->slots_mask + 1;
+  if ((table->used_num + table->removed_num + 1) * 2 <= slots_num) {
+    return;
+  }
+
+  Id **old_slots = table->slots;
+  idptr_table_alloc(table, (table->used_num + 1) * 2, table->use_uuid);
+  for (uint i = 0; i < slots_num; i++) {
+    if (old_slots[i] > IDMAP_SLOT_REMOVED) {
+      idptr_table_add(table, old_slots[i]);
+    }
+  }
+  mem_freen(old_slots);
+}
+
+static void idptr_table_remove(IdPtrTable *table, const Id *id)
+{
+  for (uint i = idptr_table_hash(table, id) & table->slots_mask; table->slots[i] != NULL;
+       i = (i + 1) & table->slots_mask)
+  {
+    if (table->slots[i] == id) {
+      table->slots[i] = IDMAP_SLOT_REMOVED;
+      table->used_num--;
+      table->removed_num++;
+      return;
+    }
+  }
+}
+
+/* Only compares addresses, given `id` may point to freed memory. */
+static bool idptr_table_has_id(const IdPtrTable *table, const Id *id)
+{
+  for (uint i = lib_ghashutil_ptrhash(id) & table->slots_mask; table->slots[i] != NULL;
+       i = (i + 1) & table->slots_mask)
+  {
+    if (table->slots[i] == id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static Id *idptr_table_lookup_uuid(const IdPtrTable *table, const uint session_uuid)
+{
+  for (uint i = idptr_table_hash_uuid(session_uuid) & table->slots_mask; table->slots[i] != NULL;
+       i = (i + 1) & table->slots_mask)
+  {
+    Id *id = table->slots[i];
+    if (id != IDMAP_SLOT_REMOVED && id->session_uuid == session_uuid) {
+      return id;
     }
   }
   return NULL;
 }
 
+static void idptr_table_free(IdPtrTable *table)
+{
+  MEM_SAFE_FREE(table->slots);
+  table->slots_mask = 0;
+  table->used_num = 0;
+  table->removed_num = 0;
+}
+
+/* Gather all Ids of `main` in a new array, appended to given `ids` one (which may be NULL). */
+static Id **idmap_ids_gather(Main *main, Id **ids, uint *r_ids_num)
+{
+  Id *id;
+  uint ids_num = *r_ids_num;
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    ids_num++;
+  }
+  FOREACH_MAIN_ID_END;
+
+  ids = mem_reallocn(ids, sizeof(*ids) * MAX2(ids_num, 1));
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    ids[(*r_ids_num)++] = id;
+  }
+  FOREACH_MAIN_ID_END;
+
+  return ids;
+}
+
+typedef struct IdPtrTableBuildData {
+  IdPtrTable *table;
+  Id **ids;
+} IdPtrTableBuildData;
+
+static void idptr_table_build_fn(void *__restrict userdata,
+                                 const int iter,
+                                 const TaskParallelTLS *__restrict UNUSED(tls))
+{
+  IdPtrTableBuildData *data = userdata;
+  idptr_table_add(data->table, data->ids[iter]);
+}
+
+static void idptr_table_build(IdPtrTable *table, Id **ids, const uint ids_num, const bool use_uuid)
+{
+  idptr_table_alloc(table, ids_num, use_uuid);
+
+  IdPtrTableBuildData data = {.table = table, .ids = ids};
+  TaskParallelSettings settings;
+  lib_parallel_range_settings_defaults(&settings);
+  settings.use_threading = ids_num >= IDMAP_PARALLEL_IDS_MIN;
+  settings.min_iter_per_thread = 1024;
+  lib_task_parallel_range(0, (int)ids_num, &data, idptr_table_build_fn, &settings);
+}
+
+/* -------------------------------------------------------------------- */
+/* Id Map */
+
 struct IdNameLibMap *main_idmap_create(struct Main *main,
-                                            const bool create_valid_ids_set,
-                                            struct Main *old_main,
-                                            const int idmap_types)
+                                       const bool create_valid_ids_set,
+                                       struct Main *old_main,
+                                       const int idmap_types)
 {
-  struct IdNameLibMap *id_map = mem_mallocn(sizeof(*id_map), __func__);
+  struct IdNameLibMap *id_map = mem_callocn(sizeof(*id_map), __func__);
   id_map->main = main;
   id_map->idmap_types = idmap_types;
 
-  int index = 0;
-  while (index < INDEX_ID_MAX) {
-    struct IdNameLibTypeMap *type_map = &id_map->type_maps[index];
-    type_map->map = NULL;
-    type_map->id_type = idtype_idcode_iter_step(&index);
-    lib_assert(type_map->id_type != 0);
+  if ((idmap_types & MAIN_IDMAP_TYPE_UUID) == 0 && !create_valid_ids_set) {
+    return id_map;
   }
-  lib_assert(index == INDEX_ID_MAX);
-  id_map->type_maps_keys_pool = NULL;
+
+  /* Ids of `main` first, then the ones of `old_main` which only go into the valid ptrs set. */
+  uint ids_num = 0;
+  Id **ids = idmap_ids_gather(main, NULL, &ids_num);
+  const uint main_ids_num = ids_num;
 
   if (idmap_types & MAIN_IDMAP_TYPE_UUID) {
-    ID *id;
-    id_map->uuid_map = lib_ghash_int_new(__func__);
-    FOREACH_MAIN_ID_BEGIN (main, id) {
-      lib_assert(id->session_uuid != MAIN_ID_SESSION_UUID_UNSET);
-      void **id_ptr_v;
-      const bool existing_key = lib_ghash_ensure_p(
-          id_map->uuid_map, PTR_FROM_UINT(id->session_uuid), &id_ptr_v);
-      lib_assert(existing_key == false);
-      UNUSED_VARS_NDEBUG(existing_key);
-
-      *id_ptr_v = id;
+#ifndef NDEBUG
+    for (uint i = 0; i < main_ids_num; i++) {
+      lib_assert(ids[i]->session_uuid != MAIN_ID_SESSION_UUID_UNSET);
     }
-    FOREACH_MAIN_ID_END;
-  }
-  else {
-    id_map->uuid_map = NULL;
+#endif
+    idptr_table_build(&id_map->uuid_map, ids, main_ids_num, true);
   }
 
   if (create_valid_ids_set) {
-    id_map->valid_id_ptrs = main_gset_create(main, NULL);
     if (old_main != NULL) {
-      id_map->valid_id_ptrs = main_gset_create(old_main, id_map->valid_id_ptrs);
+      ids = idmap_ids_gather(old_main, ids, &ids_num);
     }
-  }
-  else {
-    id_map->valid_id_ptrs = NULL;
+    idptr_table_build(&id_map->valid_id_ptrs, ids, ids_num, false);
   }
 
+  mem_freen(ids);
+
   return id_map;
 }
 
 void main_idmap_insert_id(struct IdNameLibMap *id_map, Id *id)
 {
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) {
-    const short id_type = GS(id->name);
-    struct IDNameLib_TypeMap *type_map = main_idmap_from_idcode(id_map, id_type);
+    struct IdNameLibTypeMap *type_map = main_idmap_from_idcode(id_map, GS(id->name));
 
     /* No need to do anything if map has not been lazily created yet. */
-    if (LIKELY(type_map != NULL) && type_map->map != NULL) {
-      lib_assert(id_map->type_maps_keys_pool != NULL);
-
-      struct IDNameLib_Key *key = lib_mempool_alloc(id_map->type_maps_keys_pool);
-      key->name = id->name + 2;
-      key->lib = id->lib;
-      lib_ghash_insert(type_map->map, key, id);
+    if (LIKELY(type_map != NULL) && type_map->slots != NULL) {
+      idmap_type_map_ensure_room(type_map);
+      idmap_type_map_slot_add(type_map, idmap_name_hash(id->name + 2, id->lib), id);
     }
   }
 
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_UUID) {
-    lib_assert(id_map->uuid_map != NULL);
+    lib_assert(id_map->uuid_map.slots != NULL);
     lib_assert(id->session_uuid != MAIN_ID_SESSION_UUID_UNSET);
-    void **id_ptr_v;
-    const bool existing_key = lib_ghash_ensure_p(
-        id_map->uuid_map, PTR_FROM_UINT(id->session_uuid), &id_ptr_v);
-    lib_assert(existing_key == false);
-    UNUSED_VARS_NDEBUG(existing_key);
+    lib_assert(idptr_table_lookup_uuid(&id_map->uuid_map, id->session_uuid) == NULL);
+    idptr_table_ensure_room(&id_map->uuid_map);
+    idptr_table_add(&id_map->uuid_map, id);
+  }
 
-    *id_ptr_v = id;
+  if (id_map->valid_id_ptrs.slots != NULL) {
+    idptr_table_ensure_room(&id_map->valid_id_ptrs);
+    idptr_table_add(&id_map->valid_id_ptrs, id);
   }
+
+  IDMAP_DEBUG_VALIDATE(id_map);
 }
 
 void main_idmap_remove_id(struct IdNameLibMap *id_map, Id *id)
 {
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) {
-    const short id_type = GS(id->name);
-    struct IDNameLib_TypeMap *type_map = main_idmap_from_idcode(id_map, id_type);
+    struct IdNameLibTypeMap *type_map = main_idmap_from_idcode(id_map, GS(id->name));
 
     /* No need to do anything if map has not been lazily created yet. */
-    if (LIKELY(type_map != NULL) && type_map->map != NULL) {
-      lib_assert(id_map->type_maps_keys_pool != NULL);
-
-      /* NOTE: We cannot free the key from the MemPool here, would need new API from GHash to also
-       * retrieve key pointer. Not a big deal for now */
-      lib_ghash_remove(type_map->map, &(struct IdNameLibKey){id->name + 2, id->lib}, NULL, NULL);
+    if (LIKELY(type_map != NULL) && type_map->slots != NULL) {
+      /* Match on the Id ptr itself, the name is only used to find where to start probing. */
+      IdNameLibSlot *slot = idmap_type_map_slot_find_id(
+          type_map, idmap_name_hash(id->name + 2, id->lib), id);
+      if (slot != NULL) {
+        idmap_type_map_slot_remove(type_map, slot);
+      }
     }
   }
 
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_UUID) {
-    lib_assert(id_map->uuid_map != NULL);
+    lib_assert(id_map->uuid_map.slots != NULL);
     lib_assert(id->session_uuid != MAIN_ID_SESSION_UUID_UNSET);
 
-    lib_ghash_remove(id_map->uuid_map, PTR_FROM_UINT(id->session_uuid), NULL, NULL);
+    idptr_table_remove(&id_map->uuid_map, id);
+  }
+
+  /* The Id is about to be freed or moved to another Main, its ptr is not a valid ref anymore. */
+  if (id_map->valid_id_ptrs.slots != NULL) {
+    idptr_table_remove(&id_map->valid_id_ptrs, id);
   }
 }
 
-struct Main *main_idmap_main_get(struct IdNameLibMap *id_map)
+void main_idmap_rename_id(struct IdNameLibMap *id_map, Id *id, const char *old_name)
 {
-  return id_map->bmain;
+  if (id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) {
+    struct IdNameLibTypeMap *type_map = main_idmap_from_idcode(id_map, GS(id->name));
+
+    /* No need to do anything if map has not been lazily created yet. */
+    if (LIKELY(type_map != NULL) && type_map->slots != NULL) {
+      IdNameLibSlot *slot = idmap_type_map_slot_find_id(
+          type_map, idmap_name_hash(old_name, id->lib), id);
+      lib_assert(slot != NULL);
+      if (slot != NULL) {
+        /* The new hash leads to another probing position, re-insert the Id. */
+        idmap_type_map_slot_remove(type_map, slot);
+        idmap_type_map_ensure_room(type_map);
+        idmap_type_map_slot_add(type_map, idmap_name_hash(id->name + 2, id->lib), id);
+      }
+    }
+  }
+
+  /* Nothing to do for the uuid and valid ptrs mappings, they do not depend on the name. */
+  IDMAP_DEBUG_VALIDATE(id_map);
 }
 
-static unsigned int idkey_hash(const void *ptr)
+void main_idmap_name_maps_ensure(struct IdNameLibMap *id_map)
 {
-  const struct IdNameLib_Key *idkey = ptr;
-  unsigned int key = lib_ghashutil_strhash(idkey->name);
-  if (idkey->lib) {
-    key ^= lib_ghashutil_ptrhash(idkey->lib);
+  if ((id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) == 0) {
+    return;
+  }
+  for (int index = 0; index < INDEX_ID_MAX; index++) {
+    struct IdNameLibTypeMap *type_map = &id_map->type_maps[index];
+    if (type_map->slots == NULL) {
+      idmap_type_map_build(id_map, type_map, idtype_idcode_from_index(index));
+    }
   }
-  return key;
 }
 
-static bool idkey_cmp(const void *a, const void *b)
+struct Main *main_idmap_main_get(struct IdNameLibMap *id_map)
 {
-  const struct IdNameLib_Key *idkey_a = a;
-  const struct IdNameLib_Key *idkey_b = b;
-  return !STREQ(idkey_a->name, idkey_b->name) || (idkey_a->lib != idkey_b->lib);
+  return id_map->main;
 }
 
 Id *main_idmap_lookup_name(struct IdNameLibMap *id_map,
-                               short id_type,
-                               const char *name,
-                               const Library *lib)
+                           const short id_type,
+                           const char *name,
+                           const Lib *lib)
 {
   struct IdNameLibTypeMap *type_map = main_idmap_from_idcode(id_map, id_type);
 
@@ -203,24 +529,22 @@ Id *main_idmap_lookup_name(struct IdNameLibMap *id_map,
   }
 
   /* Lazy init. */
-  if (type_map->map == NULL) {
-    if (id_map->type_maps_keys_pool == NULL) {
-      id_map->type_maps_keys_pool = lib_mempool_create(
-          sizeof(struct IdNameLibKey), 1024, 1024, LIB_MEMPOOL_NOP);
-    }
+  if (type_map->slots == NULL) {
+    idmap_type_map_build(id_map, type_map, id_type);
+  }
 
-    GHash *map = type_map->map = lib_ghash_new(idkey_hash, idkey_cmp, __func__);
-    List *lb = which_lib(id_map->main, id_type);
-    for (Id *id = lb->first; id; id = id->next) {
-      struct IdNameLib_Key *key = lib_mempool_alloc(id_map->type_maps_keys_pool);
-      key->name = id->name + 2;
-      key->lib = id->lib;
-      lib_ghash_insert(map, key, id);
+  const uint hash = idmap_name_hash(name, lib);
+  for (uint i = hash & type_map->slots_mask; type_map->slots[i].id != NULL;
+       i = (i + 1) & type_map->slots_mask)
+  {
+    const IdNameLibSlot *slot = &type_map->slots[i];
+    if (slot->hash == hash && slot->lib == lib && IDMAP_SLOT_IS_USED(slot) &&
+        STREQ(slot->id->name + 2, name))
+    {
+      return slot->id;
     }
   }
-
-  const struct IdNameLibKey key_lookup = {name, lib};
-  return lib_ghash_lookup(type_map->map, &key_lookup);
+  return NULL;
 }
 
 Id *main_idmap_lookup_id(struct IdNameLibMap *id_map, const Id *id)
@@ -230,44 +554,88 @@ Id *main_idmap_lookup_id(struct IdNameLibMap *id_map, const Id *id)
    * so it has to check that it does exist in 'old' (aka current) Main database.
    * Otherwise, we cannot provide new Id ptr that way (would crash accessing freed memory
    * when trying to get Id name) */
-  if (id_map->valid_id_ptrs == NULL || lib_gset_haskey(id_map->valid_id_ptrs, id)) {
+  if (id_map->valid_id_ptrs.slots == NULL || idptr_table_has_id(&id_map->valid_id_ptrs, id)) {
     return main_idmap_lookup_name(id_map, GS(id->name), id->name + 2, id->lib);
   }
   return NULL;
 }
 
-Id main_idmap_lookup_uuid(struct IdNameLibMap *id_map, const uint session_uuid)
+Id *main_idmap_lookup_uuid(struct IdNameLibMap *id_map, const uint session_uuid)
 {
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_UUID) {
-    return lib_ghash_lookup(id_map->uuid_map, PTR_FROM_UINT(session_uuid));
+    return idptr_table_lookup_uuid(&id_map->uuid_map, session_uuid);
   }
   return NULL;
 }
 
-void main_idmap_destroy(struct IdNameLibMap *id_map)
+bool main_idmap_validate(struct IdNameLibMap *id_map)
 {
+  bool is_valid = true;
+
   if (id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) {
-    struct IdNameLibTypeMap *type_map = id_map->type_maps;
-    for (int i = 0; i < INDEX_ID_MAX; i++, type_map++) {
-      if (type_map->map) {
-        lib_ghash_free(type_map->map, NULL, NULL);
-        type_map->map = NULL;
+    for (int index = 0; index < INDEX_ID_MAX; index++) {
+      struct IdNameLibTypeMap *type_map = &id_map->type_maps[index];
+      if (type_map->slots == NULL) {
+        continue;
+      }
+      const short id_type = idtype_idcode_from_index(index);
+      List *lb = which_lib(id_map->main, id_type);
+      uint ids_num = 0;
+      LIST_FOREACH (Id *, id, lb) {
+        if (main_idmap_lookup_name(id_map, id_type, id->name + 2, id->lib) != id) {
+          CLOG_ERROR(&LOG, "Id '%s' cannot be found by its name", id->name);
+          is_valid = false;
+        }
+        ids_num++;
+      }
+      if (type_map->used_num != ids_num) {
+        CLOG_ERROR(&LOG,
+                   "Name map of Id type '%s' stores %u Ids, but Main has %u of them",
+                   idtype_idcode_to_name(id_type),
+                   type_map->used_num,
+                   ids_num);
+        is_valid = false;
       }
     }
-    if (id_map->type_maps_keys_pool != NULL) {
-      lib_mempool_destroy(id_map->type_maps_keys_pool);
-      id_map->type_maps_keys_pool = NULL;
+  }
+
+  Id *id;
+  uint ids_num = 0;
+  FOREACH_MAIN_ID_BEGIN (id_map->main, id) {
+    if ((id_map->idmap_types & MAIN_IDMAP_TYPE_UUID) &&
+        main_idmap_lookup_uuid(id_map, id->session_uuid) != id)
+    {
+      CLOG_ERROR(&LOG, "Id '%s' cannot be found by its session uuid", id->name);
+      is_valid = false;
+    }
+    if (id_map->valid_id_ptrs.slots != NULL && !idptr_table_has_id(&id_map->valid_id_ptrs, id)) {
+      CLOG_ERROR(&LOG, "Id '%s' is missing from the valid Id ptrs set", id->name);
+      is_valid = false;
     }
+    ids_num++;
   }
-  if (id_map->idmap_types & MAIN_IDMAP_TYPE_UUID) {
-    lib_ghash_free(id_map->uuid_map, NULL, NULL);
+  FOREACH_MAIN_ID_END;
+
+  if ((id_map->idmap_types & MAIN_IDMAP_TYPE_UUID) && id_map->uuid_map.used_num != ids_num) {
+    CLOG_ERROR(&LOG,
+               "Session uuid map stores %u Ids, but Main has %u of them",
+               id_map->uuid_map.used_num,
+               ids_num);
+    is_valid = false;
   }
 
-  lib_assert(id_map->type_maps_keys_pool == NULL);
+  return is_valid;
+}
 
-  if (id_map->valid_id_ptrs != NULL) {
-    lib_gset_free(id_map->valid_id_ptrs, NULL);
+void main_idmap_destroy(struct IdNameLibMap *id_map)
+{
+  if (id_map->idmap_types & MAIN_IDMAP_TYPE_NAME) {
+    for (int i = 0; i < INDEX_ID_MAX; i++) {
+      idmap_type_map_free(&id_map->type_maps[i]);
+    }
   }
+  idptr_table_free(&id_map->uuid_map);
+  idptr_table_free(&id_map->valid_id_ptrs);
 
   mem_freen(id_map);
 }
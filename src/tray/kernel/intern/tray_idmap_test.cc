@@ -0,0 +1,158 @@
+#include "testing/testing.h"
+
+#include <cstdlib>
+#include <string>
+
+#include "lib_list.h"
+#include "lib_string.h"
+#include "lib_timeit.hh"
+
+#include "types_id.h"
+
+#include "tray_idtype.h"
+#include "tray_lib_id.h"
+#include "tray_main.h"
+#include "tray_main_idmap.h"
+
+namespace dune::tests {
+
+class IdMapTest : public testing::Test {
+ public:
+  static void SetUpTestSuite()
+  {
+    idtype_init();
+  }
+};
+
+static Main *idmap_test_main_create(const int ids_num)
+{
+  Main *main = main_new();
+  char name[MAX_ID_NAME - 2];
+  for (int i = 0; i < ids_num; i++) {
+    lib_snprintf(name, sizeof(name), "OB%d", i);
+    libblock_alloc(main, ID_OB, name, 0);
+  }
+  return main;
+}
+
+static void idmap_test_lookups_check(IdNameLibMap *id_map, Main *main)
+{
+  Id *id;
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    EXPECT_EQ(main_idmap_lookup_uuid(id_map, id->session_uuid), id);
+    EXPECT_EQ(main_idmap_lookup_id(id_map, id), id);
+    EXPECT_EQ(main_idmap_lookup_name(id_map, GS(id->name), id->name + 2, id->lib), id);
+  }
+  FOREACH_MAIN_ID_END;
+}
+
+/* Enough Ids for the tables to be built from multiple threads. */
+TEST_F(IdMapTest, create_parallel)
+{
+  Main *main = idmap_test_main_create(20000);
+  IdNameLibMap *id_map = main_idmap_create(
+      main, true, nullptr, MAIN_IDMAP_TYPE_NAME | MAIN_IDMAP_TYPE_UUID);
+  idmap_test_lookups_check(id_map, main);
+  EXPECT_TRUE(main_idmap_validate(id_map));
+  main_idmap_destroy(id_map);
+  main_free(main);
+}
+
+TEST_F(IdMapTest, create_with_old_main)
+{
+  Main *main = idmap_test_main_create(100);
+  Main *old_main = idmap_test_main_create(20000);
+  IdNameLibMap *id_map = main_idmap_create(
+      main, true, old_main, MAIN_IDMAP_TYPE_NAME | MAIN_IDMAP_TYPE_UUID);
+
+  /* Ids of the old Main are valid, and map to the Id of the same name in the new one. */
+  Id *id;
+  FOREACH_MAIN_ID_BEGIN (old_main, id) {
+    Id *new_id = main_idmap_lookup_id(id_map, id);
+    if (atoi(id->name + 4) < 100) {
+      ASSERT_NE(new_id, nullptr);
+      EXPECT_STREQ(new_id->name, id->name);
+    }
+    else {
+      EXPECT_EQ(new_id, nullptr);
+    }
+  }
+  FOREACH_MAIN_ID_END;
+
+  main_idmap_destroy(id_map);
+  main_free(old_main);
+  main_free(main);
+}
+
+TEST_F(IdMapTest, main_id_index)
+{
+  Main *main = idmap_test_main_create(100);
+  /* Without an index, lookups walk the Id lists. */
+  Id *id = main_id_index_lookup_name(main, ID_OB, "OB10", nullptr);
+  ASSERT_NE(id, nullptr);
+  EXPECT_STREQ(id->name + 2, "OB10");
+
+  main_id_index_ensure(main);
+  EXPECT_EQ(main_id_index_lookup_name(main, ID_OB, "OB10", nullptr), id);
+  EXPECT_EQ(main_id_index_lookup_name(main, ID_OB, "OB1000", nullptr), nullptr);
+
+  Id *new_id = static_cast<Id *>(libblock_alloc(main, ID_OB, "New", 0));
+  main_id_index_add_id(main, new_id);
+  EXPECT_EQ(main_id_index_lookup_name(main, ID_OB, "New", nullptr), new_id);
+  EXPECT_TRUE(main_idmap_validate(main->id_index));
+
+  main_id_index_remove_id(main, id);
+  lib_remlink(which_lib(main, ID_OB), id);
+  EXPECT_EQ(main_id_index_lookup_name(main, ID_OB, "OB10", nullptr), nullptr);
+  EXPECT_TRUE(main_idmap_validate(main->id_index));
+  id_free(nullptr, id);
+
+  main_free(main);
+}
+
+TEST_F(IdMapTest, main_id_index_uuid)
+{
+  Main *main = idmap_test_main_create(100);
+  Id *id = static_cast<Id *>(which_lib(main, ID_OB)->first);
+  EXPECT_EQ(main_id_index_lookup_uuid(main, id->session_uuid), id);
+
+  main_id_index_ensure(main);
+  EXPECT_EQ(main_id_index_lookup_uuid(main, id->session_uuid), id);
+  EXPECT_EQ(main_id_index_lookup_uuid(main, MAIN_ID_SESSION_UUID_UNSET), nullptr);
+
+  const uint old_uuid = id->session_uuid;
+  libblock_session_uuid_renew(id);
+  main_id_index_update_uuid(main, id, old_uuid);
+  EXPECT_EQ(main_id_index_lookup_uuid(main, id->session_uuid), id);
+  EXPECT_EQ(main_id_index_lookup_uuid(main, old_uuid), nullptr);
+
+  main_id_index_free(main);
+  EXPECT_EQ(main_id_index_lookup_uuid(main, id->session_uuid), id);
+  main_free(main);
+}
+
+/* Timings of main_idmap_create for growing amounts of Ids, run with
+ * `--gtest_also_run_disabled_tests`. */
+TEST_F(IdMapTest, DISABLED_benchmark_create)
+{
+  for (const int ids_num : {10000, 100000, 1000000}) {
+    Main *main = idmap_test_main_create(ids_num);
+    IdNameLibMap *id_map;
+    {
+      SCOPED_TIMER("main_idmap_create, " + std::to_string(ids_num) + " Ids");
+      id_map = main_idmap_create(main, true, nullptr, MAIN_IDMAP_TYPE_UUID);
+    }
+    {
+      SCOPED_TIMER("main_idmap_lookup_uuid, " + std::to_string(ids_num) + " Ids");
+      Id *id;
+      FOREACH_MAIN_ID_BEGIN (main, id) {
+        EXPECT_EQ(main_idmap_lookup_uuid(id_map, id->session_uuid), id);
+      }
+      FOREACH_MAIN_ID_END;
+    }
+    main_idmap_destroy(id_map);
+    main_free(main);
+  }
+}
+
+}  // namespace dune::tests
@@ -1,8 +1,10 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "mem_guardedalloc.h"
 
 #include "lib_ghash.h"
+#include "lib_math_bits.h"
 #include "lib_utildefines.h"
 
 #include "CLG_log.h"
@@ -36,69 +38,161 @@ bool idtype_cache_key_cmp(const void *key_a_v, const void *key_b_v)
          (key_a->offset_in_Id != key_b->offset_in_id) || (key_a->cache_v != key_b->cache_v);
 }
 
+/* Registry of all Id types, as `X(id, filter)` where `id` is the suffix of their `ID_`,
+ * `INDEX_ID_` and `IdType_ID_` names, and `filter` is their `FILTER_ID_` suffix (`NONE` for types
+ * which have no filter). All lookup tables below are generated from it.
+ *
+ * note ID_LINK_PLACEHOLDER is not part of it, it is handled separately. */
+#define IDTYPE_REGISTRY(X) \
+  X(SCE, SCE) \
+  X(LI, NONE) \
+  X(OB, OB) \
+  X(ME, ME) \
+  X(CU_LEGACY, CU_LEGACY) \
+  X(MB, MB) \
+  X(MA, MA) \
+  X(TE, TE) \
+  X(IM, IM) \
+  X(LT, LT) \
+  X(LA, LA) \
+  X(CA, CA) \
+  X(IP, NONE) \
+  X(KE, NONE) \
+  X(WO, WO) \
+  X(SCR, NONE) \
+  X(VF, VF) \
+  X(TXT, TXT) \
+  X(SPK, SPK) \
+  X(SO, SO) \
+  X(GR, GR) \
+  X(AR, AR) \
+  X(AC, AC) \
+  X(NT, NT) \
+  X(BR, BR) \
+  X(PA, PA) \
+  X(GD, GD) \
+  X(WM, NONE) \
+  X(MC, MC) \
+  X(MSK, MSK) \
+  X(LS, LS) \
+  X(PAL, PAL) \
+  X(PC, PC) \
+  X(CF, CF) \
+  X(WS, WS) \
+  X(LP, LP) \
+  X(CV, CV) \
+  X(PT, PT) \
+  X(VO, VO) \
+  X(SIM, SIM)
+
+#define FILTER_ID_NONE 0
+
+/* Id codes are made of two upper case letters, see MAKE_ID2. Their slot in the 26 * 26 table
+ * below is computed from their two bytes, whichever the byte order is. The slot of a code which
+ * is not made of upper case letters would be out of the table or collide with another one, so
+ * all codes of the registry are checked at build time. */
+#define IDTYPE_IDCODE_CHAR_A(_idcode) ((uint)(_idcode)&0xff)
+#define IDTYPE_IDCODE_CHAR_B(_idcode) (((uint)(_idcode) >> 8) & 0xff)
+#define IDTYPE_IDCODE_CHAR_IS_VALID(_char) ((_char) >= 'A' && (_char) <= 'Z')
+#define IDTYPE_IDCODE_IS_VALID(_idcode) \
+  (IDTYPE_IDCODE_CHAR_IS_VALID(IDTYPE_IDCODE_CHAR_A(_idcode)) && \
+   IDTYPE_IDCODE_CHAR_IS_VALID(IDTYPE_IDCODE_CHAR_B(_idcode)))
+#define IDTYPE_IDCODE_SLOT(_idcode) \
+  ((IDTYPE_IDCODE_CHAR_A(_idcode) - 'A') * 26 + (IDTYPE_IDCODE_CHAR_B(_idcode) - 'A'))
+#define IDTYPE_IDCODE_SLOTS_NUM (26 * 26)
+
+#define X(_id, _filter) \
+  LIB_STATIC_ASSERT(IDTYPE_IDCODE_IS_VALID(ID_##_id), "ID_" #_id " is not two upper case letters")
+IDTYPE_REGISTRY(X)
+#undef X
+LIB_STATIC_ASSERT(IDTYPE_IDCODE_IS_VALID(ID_LINK_PLACEHOLDER),
+                  "ID_LINK_PLACEHOLDER is not two upper case letters")
+
+/* `INDEX_ID_` of each Id code slot, plus one (zero for invalid Id codes). */
+static const uchar idtype_index_from_idcode_slot[IDTYPE_IDCODE_SLOTS_NUM] = {
+#define X(_id, _filter) [IDTYPE_IDCODE_SLOT(ID_##_id)] = INDEX_ID_##_id + 1,
+    IDTYPE_REGISTRY(X)
+#undef X
+    /* Special naughty boy... */
+    [IDTYPE_IDCODE_SLOT(ID_LINK_PLACEHOLDER)] = INDEX_ID_NULL + 1,
+};
+
+static const short idtype_idcode_from_index_table[INDEX_ID_MAX] = {
+#define X(_id, _filter) [INDEX_ID_##_id] = ID_##_id,
+    IDTYPE_REGISTRY(X)
+#undef X
+    [INDEX_ID_NULL] = ID_LINK_PLACEHOLDER,
+};
+
+static const uint64_t idtype_idfilter_from_index[INDEX_ID_MAX] = {
+#define X(_id, _filter) [INDEX_ID_##_id] = FILTER_ID_##_filter,
+    IDTYPE_REGISTRY(X)
+#undef X
+};
+
+/* Id code of each `FILTER_ID_` bit, filled by idtype_init. */
+static short idtype_idcode_from_idfilter_bit[64] = {0};
+
+/* Id type names sorted alphabetically, for binary search, filled by idtype_init. */
+typedef struct IdTypeNameItem {
+  const char *name;
+  short id_code;
+} IdTypeNameItem;
+static IdTypeNameItem idtype_names_sorted[INDEX_ID_MAX];
+static int idtype_names_sorted_num = 0;
+
 static IdTypeInfo *id_types[INDEX_ID_MAX] = {NULL};
 
 static void id_type_init(void)
 {
-#define INIT_TYPE(_id_code) \
-  { \
-    lib_assert(IdType_##_id_code.main_list_index == INDEX_##_id_code); \
-    id_types[INDEX_##_id_code] = &IdType_##_id_code; \
-  } \
-  (void)0
-
-  INIT_TYPE(ID_SCE);
-  INIT_TYPE(ID_LI);
-  INIT_TYPE(ID_OB);
-  INIT_TYPE(ID_ME);
-  INIT_TYPE(ID_CU_LEGACY);
-  INIT_TYPE(ID_MB);
-  INIT_TYPE(ID_MA);
-  INIT_TYPE(ID_TE);
-  INIT_TYPE(ID_IM);
-  INIT_TYPE(ID_LT);
-  INIT_TYPE(ID_LA);
-  INIT_TYPE(ID_CA);
-  INIT_TYPE(ID_IP);
-  INIT_TYPE(ID_KE);
-  INIT_TYPE(ID_WO);
-  INIT_TYPE(ID_SCR);
-  INIT_TYPE(ID_VF);
-  INIT_TYPE(ID_TXT);
-  INIT_TYPE(ID_SPK);
-  INIT_TYPE(ID_SO);
-  INIT_TYPE(ID_GR);
-  INIT_TYPE(ID_AR);
-  INIT_TYPE(ID_AC);
-  INIT_TYPE(ID_NT);
-  INIT_TYPE(ID_BR);
-  INIT_TYPE(ID_PA);
-  INIT_TYPE(ID_GD);
-  INIT_TYPE(ID_WM);
-  INIT_TYPE(ID_MC);
-  INIT_TYPE(ID_MSK);
-  INIT_TYPE(ID_LS);
-  INIT_TYPE(ID_PAL);
-  INIT_TYPE(ID_PC);
-  INIT_TYPE(ID_CF);
-  INIT_TYPE(ID_WS);
-  INIT_TYPE(ID_LP);
-  INIT_TYPE(ID_CV);
-  INIT_TYPE(ID_PT);
-  INIT_TYPE(ID_VO);
-  INIT_TYPE(ID_SIM);
+#define X(_id, _filter) \
+  lib_assert(IdType_ID_##_id.main_list_index == INDEX_ID_##_id); \
+  id_types[INDEX_ID_##_id] = &IdType_ID_##_id;
+
+  IDTYPE_REGISTRY(X)
+
+#undef X
 
   /* Special naughty boy... */
   lib_assert(IdType_ID_LINK_PLACEHOLDER.main_list_index == INDEX_ID_NULL);
   id_types[INDEX_ID_NULL] = &IdType_ID_LINK_PLACEHOLDER;
+}
 
-#undef INIT_TYPE
+static int idtype_name_item_cmp(const void *a, const void *b)
+{
+  return strcmp(((const IdTypeNameItem *)a)->name, ((const IdTypeNameItem *)b)->name);
+}
+
+static void id_type_tables_init(void)
+{
+  for (int index = 0; index < INDEX_ID_MAX; index++) {
+    const uint64_t idfilter = idtype_idfilter_from_index[index];
+    if (idfilter != 0) {
+      lib_assert((idfilter & (idfilter - 1)) == 0);
+      idtype_idcode_from_idfilter_bit[bitscan_forward_uint64(idfilter)] =
+          idtype_idcode_from_index_table[index];
+    }
+  }
+
+  idtype_names_sorted_num = 0;
+  for (int index = 0; index < INDEX_ID_MAX; index++) {
+    if (id_types[index] != NULL && id_types[index]->name[0] != '\0') {
+      IdTypeNameItem *item = &idtype_names_sorted[idtype_names_sorted_num++];
+      item->name = id_types[index]->name;
+      item->id_code = id_types[index]->id_code;
+    }
+  }
+  qsort(idtype_names_sorted,
+        (size_t)idtype_names_sorted_num,
+        sizeof(*idtype_names_sorted),
+        idtype_name_item_cmp);
 }
 
 void idtype_init(void)
 {
   /* Initialize data-block types. */
   id_type_init();
+  id_type_tables_init();
 }
 
 const IdTypeInfo *idtype_get_info_from_idcode(const short id_code)
@@ -120,13 +214,13 @@ const IdTypeInfo *idtype_get_info_from_id(const Id *id)
 
 static const IdTypeInfo *idtype_get_info_from_name(const char *idtype_name)
 {
-  for (int i = ARRAY_SIZE(id_types); i--;) {
-    if (id_types[i] != NULL && STREQ(idtype_name, id_types[i]->name)) {
-      return id_types[i];
-    }
-  }
-
-  return NULL;
+  const IdTypeNameItem key = {idtype_name, 0};
+  const IdTypeNameItem *item = bsearch(&key,
+                                       idtype_names_sorted,
+                                       (size_t)idtype_names_sorted_num,
+                                       sizeof(*idtype_names_sorted),
+                                       idtype_name_item_cmp);
+  return item != NULL ? idtype_get_info_from_idcode(item->id_code) : NULL;
 }
 
 /* Various helpers/wrappers around IdTypeInfo structure. */
@@ -196,222 +290,41 @@ bool idtype_idcode_append_is_reusable(const short idcode)
 
 uint64_t idtype_idcode_to_idfilter(const short idcode)
 {
-#define CASE_IDFILTER(_id) \
-  case Id_##_id: \
-    return FILTER_ID_##_id
-
-  switch (idcode) {
-    CASE_IDFILTER(AC);
-    CASE_IDFILTER(AR);
-    CASE_IDFILTER(BR);
-    CASE_IDFILTER(CA);
-    CASE_IDFILTER(CF);
-    CASE_IDFILTER(CU_LEGACY);
-    CASE_IDFILTER(GD);
-    CASE_IDFILTER(GR);
-    CASE_IDFILTER(CV);
-    CASE_IDFILTER(IM);
-    CASE_IDFILTER(LA);
-    CASE_IDFILTER(LS);
-    CASE_IDFILTER(LT);
-    CASE_IDFILTER(MA);
-    CASE_IDFILTER(MB);
-    CASE_IDFILTER(MC);
-    CASE_IDFILTER(ME);
-    CASE_IDFILTER(MSK);
-    CASE_IDFILTER(NT);
-    CASE_IDFILTER(OB);
-    CASE_IDFILTER(PA);
-    CASE_IDFILTER(PAL);
-    CASE_IDFILTER(PC);
-    CASE_IDFILTER(PT);
-    CASE_IDFILTER(LP);
-    CASE_IDFILTER(SCE);
-    CASE_IDFILTER(SIM);
-    CASE_IDFILTER(SPK);
-    CASE_IDFILTER(SO);
-    CASE_IDFILTER(TE);
-    CASE_IDFILTER(TXT);
-    CASE_IDFILTER(VF);
-    CASE_IDFILTER(VO);
-    CASE_IDFILTER(WO);
-    CASE_IDFILTER(WS);
-    default:
-      return 0;
-  }
-
-#undef CASE_IDFILTER
+  const int index = idtype_idcode_to_index(idcode);
+  return index >= 0 ? idtype_idfilter_from_index[index] : 0;
 }
 
 short idtype_idcode_from_idfilter(const uint64_t idfilter)
 {
-#define CASE_IDFILTER(_id) \
-  case FILTER_ID_##_id: \
-    return ID_##_id
-
-  switch (idfilter) {
-    CASE_IDFILTER(AC);
-    CASE_IDFILTER(AR);
-    CASE_IDFILTER(BR);
-    CASE_IDFILTER(CA);
-    CASE_IDFILTER(CF);
-    CASE_IDFILTER(CU_LEGACY);
-    CASE_IDFILTER(GD);
-    CASE_IDFILTER(GR);
-    CASE_IDFILTER(CV);
-    CASE_IDFILTER(IM);
-    CASE_IDFILTER(LA);
-    CASE_IDFILTER(LS);
-    CASE_IDFILTER(LT);
-    CASE_IDFILTER(MA);
-    CASE_IDFILTER(MB);
-    CASE_IDFILTER(MC);
-    CASE_IDFILTER(ME);
-    CASE_IDFILTER(MSK);
-    CASE_IDFILTER(NT);
-    CASE_IDFILTER(OB);
-    CASE_IDFILTER(PA);
-    CASE_IDFILTER(PAL);
-    CASE_IDFILTER(PC);
-    CASE_IDFILTER(PT);
-    CASE_IDFILTER(LP);
-    CASE_IDFILTER(SCE);
-    CASE_IDFILTER(SIM);
-    CASE_IDFILTER(SPK);
-    CASE_IDFILTER(SO);
-    CASE_IDFILTER(TE);
-    CASE_IDFILTER(TXT);
-    CASE_IDFILTER(VF);
-    CASE_IDFILTER(VO);
-    CASE_IDFILTER(WO);
-    default:
-      return 0;
+  /* Only single `FILTER_ID_` values match an Id code. */
+  if (idfilter == 0 || (idfilter & (idfilter - 1)) != 0) {
+    return 0;
   }
-
-#undef CASE_IDFILTER
+  return idtype_idcode_from_idfilter_bit[bitscan_forward_uint64(idfilter)];
 }
 
 int idtype_idcode_to_index(const short idcode)
 {
-#define CASE_IDINDEX(_id) \
-  case ID_##_id: \
-    return INDEX_ID_##_id
-
-  switch ((Id_Type)idcode) {
-    CASE_IDINDEX(AC);
-    CASE_IDINDEX(AR);
-    CASE_IDINDEX(BR);
-    CASE_IDINDEX(CA);
-    CASE_IDINDEX(CF);
-    CASE_IDINDEX(CU_LEGACY);
-    CASE_IDINDEX(GD);
-    CASE_IDINDEX(GR);
-    CASE_IDINDEX(CV);
-    CASE_IDINDEX(IM);
-    CASE_IDINDEX(IP);
-    CASE_IDINDEX(KE);
-    CASE_IDINDEX(LA);
-    CASE_IDINDEX(LI);
-    CASE_IDINDEX(LS);
-    CASE_IDINDEX(LT);
-    CASE_IDINDEX(MA);
-    CASE_IDINDEX(MB);
-    CASE_IDINDEX(MC);
-    CASE_IDINDEX(ME);
-    CASE_IDINDEX(MSK);
-    CASE_IDINDEX(NT);
-    CASE_IDINDEX(OB);
-    CASE_IDINDEX(PA);
-    CASE_IDINDEX(PAL);
-    CASE_IDINDEX(PC);
-    CASE_IDINDEX(PT);
-    CASE_IDINDEX(LP);
-    CASE_IDINDEX(SCE);
-    CASE_IDINDEX(SCR);
-    CASE_IDINDEX(SIM);
-    CASE_IDINDEX(SPK);
-    CASE_IDINDEX(SO);
-    CASE_IDINDEX(TE);
-    CASE_IDINDEX(TXT);
-    CASE_IDINDEX(VF);
-    CASE_IDINDEX(VO);
-    CASE_IDINDEX(WM);
-    CASE_IDINDEX(WO);
-    CASE_IDINDEX(WS);
-  }
-
-  /* Special naughty boy... */
-  if (idcode == ID_LINK_PLACEHOLDER) {
-    return INDEX_ID_NULL;
+  /* Unsigned arithmetic, so that bytes below 'A' are out of range too. */
+  const uint char_a = IDTYPE_IDCODE_CHAR_A(idcode) - 'A';
+  const uint char_b = IDTYPE_IDCODE_CHAR_B(idcode) - 'A';
+  if (char_a < 26 && char_b < 26) {
+    return (int)idtype_index_from_idcode_slot[char_a * 26 + char_b] - 1;
   }
-
   return -1;
-
-#undef CASE_IDINDEX
 }
 
 short idtype_idcode_from_index(const int index)
 {
-#define CASE_IDCODE(_id) \
-  case INDEX_ID_##_id: \
-    return ID_##_id
-
-  switch (index) {
-    CASE_IDCODE(AC);
-    CASE_IDCODE(AR);
-    CASE_IDCODE(BR);
-    CASE_IDCODE(CA);
-    CASE_IDCODE(CF);
-    CASE_IDCODE(CU_LEGACY);
-    CASE_IDCODE(GD);
-    CASE_IDCODE(GR);
-    CASE_IDCODE(CV);
-    CASE_IDCODE(IM);
-    CASE_IDCODE(IP);
-    CASE_IDCODE(KE);
-    CASE_IDCODE(LA);
-    CASE_IDCODE(LI);
-    CASE_IDCODE(LS);
-    CASE_IDCODE(LT);
-    CASE_IDCODE(MA);
-    CASE_IDCODE(MB);
-    CASE_IDCODE(MC);
-    CASE_IDCODE(ME);
-    CASE_IDCODE(MSK);
-    CASE_IDCODE(NT);
-    CASE_IDCODE(OB);
-    CASE_IDCODE(PA);
-    CASE_IDCODE(PAL);
-    CASE_IDCODE(PC);
-    CASE_IDCODE(PT);
-    CASE_IDCODE(LP);
-    CASE_IDCODE(SCE);
-    CASE_IDCODE(SCR);
-    CASE_IDCODE(SIM);
-    CASE_IDCODE(SPK);
-    CASE_IDCODE(SO);
-    CASE_IDCODE(TE);
-    CASE_IDCODE(TXT);
-    CASE_IDCODE(VF);
-    CASE_IDCODE(VO);
-    CASE_IDCODE(WM);
-    CASE_IDCODE(WO);
-    CASE_IDCODE(WS);
+  if (index >= 0 && index < INDEX_ID_MAX) {
+    return idtype_idcode_from_index_table[index];
   }
-
-  /* Special naughty boy... */
-  if (index == INDEX_ID_NULL) {
-    return ID_LINK_PLACEHOLDER;
-  }
-
   return -1;
-
-#undef CASE_IDCODE
 }
 
 short idtype_idcode_iter_step(int *index)
 {
-  return (*index < ARRAY_SIZE(id_types)) ? idtype_idcode_from_index((*index)++) : 0;
+  return (*index < INDEX_ID_MAX) ? idtype_idcode_from_index_table[(*index)++] : 0;
 }
 
 void idtype_id_foreach_cache(struct Id *id,
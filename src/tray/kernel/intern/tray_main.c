@@ -4,10 +4,19 @@
 
 #include "mem_guardedalloc.h"
 
+#include "atomic_ops.h"
+
 #include "lib_tray.h"
+#include "lib_bitmap.h"
 #include "lib_ghash.h"
+#include "lib_hash_md5.h"
+#include "lib_math_base.h"
+#include "lib_math_bits.h"
+#include "lib_memarena.h"
 #include "lib_mempool.h"
+#include "lib_task.h"
 #include "lib_threads.h"
+#include "lib_timer.h"
 
 #include "STRUCT_ID.h"
 
@@ -21,14 +30,313 @@
 #include "imbuf.h"
 #include "imbuf_types.h"
 
+/* Reader-writer lock of a Main, see `main_lock` API.
+ *
+ * Whole Main locks take `global` in the requested mode, type locks take `global` for reading and
+ * their shard in the requested mode. Whole Main readers also take all shards for reading (always
+ * in index order), so that they exclude type writers. */
+struct MainLock {
+  ThreadRWMutex global;
+  ThreadRWMutex shards[INDEX_ID_MAX];
+  /* Start time of the current exclusive hold of `global` and each shard. Only written by the
+   * thread holding the matching lock for writing. */
+  double global_write_start;
+  double shards_write_start[INDEX_ID_MAX];
+  /* Whether each shard is currently held for writing, to know what to account on unlock. */
+  bool shards_write[INDEX_ID_MAX];
+
+  MainLockStats stats;
+};
+
+static struct MainLock *main_lock_create(void)
+{
+  struct MainLock *lock = mem_callocn(sizeof(*lock), "main lock");
+  lib_rw_mutex_init(&lock->global);
+  for (int i = 0; i < INDEX_ID_MAX; i++) {
+    lib_rw_mutex_init(&lock->shards[i]);
+  }
+  return lock;
+}
+
+static void main_lock_free(struct MainLock *lock)
+{
+  lib_rw_mutex_end(&lock->global);
+  for (int i = 0; i < INDEX_ID_MAX; i++) {
+    lib_rw_mutex_end(&lock->shards[i]);
+  }
+  mem_freen(lock);
+}
+
+/* Waits on a lock longer than that (in seconds) are counted as contended. An uncontended lock
+ * only costs a few atomic operations, way below that. */
+#define MAIN_LOCK_CONTENDED_WAIT 1e-6
+
+/* Lock `mutex`, counting the acquisition, the time spent waiting and whether it was contended. */
+static void main_lock_rw_mutex_lock(struct MainLock *lock, ThreadRWMutex *mutex, const int mode)
+{
+  const double start = lib_check_seconds_timer();
+  lib_rw_mutex_lock(mutex, mode);
+  const double wait = lib_check_seconds_timer() - start;
+  if (wait > MAIN_LOCK_CONTENDED_WAIT) {
+    atomic_add_and_fetch_uint64(&lock->stats.contended_num, 1);
+  }
+  atomic_add_and_fetch_uint64(&lock->stats.wait_time_us, (uint64_t)(wait * 1e6));
+  atomic_add_and_fetch_uint64(
+      mode == THREAD_LOCK_WRITE ? &lock->stats.write_acquired_num : &lock->stats.read_acquired_num,
+      1);
+}
+
+static void main_lock_write_time_add(struct MainLock *lock, const double start)
+{
+  const double duration = lib_check_seconds_timer() - start;
+  atomic_add_and_fetch_uint64(&lock->stats.write_hold_time_us, (uint64_t)(duration * 1e6));
+}
+
 Main *main_new(void)
 {
   Main *main = mem_callocn(sizeof(Main), "new main");
-  main->lock = mem_mallocn(sizeof(SpinLock), "main lock");
-  lib_spin_init((SpinLock *)main->lock);
+  main->lock = main_lock_create();
   return main;
 }
 
+/* Phases of freeing the Id lists of a Main, when using MAIN_FREE_THREADED or
+ * MAIN_FREE_DEFERRED, in the order they are run. Within each phase, lists are freed in the same
+ * order as main_free. */
+typedef enum eMainFreePhase {
+  /* UI types, freed first on the calling thread while the data they reference is still valid. */
+  MAIN_FREE_PHASE_UI = 0,
+  /* Types whose freeing touches GPU or other global state (GPU materials and textures, audio
+   * handles, font caches...), always freed on the calling thread, even with MAIN_FREE_DEFERRED.
+   * Freeing them before the other types is safe, as only the types of the last phase are
+   * referenced by freeing code (see set_listptrs). */
+  MAIN_FREE_PHASE_MAIN_THREAD = 1,
+  /* Types whose freeing does not depend on other types, one worker task per list. */
+  MAIN_FREE_PHASE_PARALLEL = 2,
+  /* Types referenced by the freeing code of others (see set_listptrs), freed last on the calling
+   * thread. */
+  MAIN_FREE_PHASE_LAST = 3,
+} eMainFreePhase;
+
+static eMainFreePhase main_free_phase_from_index(const int index)
+{
+  switch (index) {
+    case INDEX_ID_WM:
+    case INDEX_ID_WS:
+    case INDEX_ID_SCR:
+      return MAIN_FREE_PHASE_UI;
+    case INDEX_ID_OB:
+    case INDEX_ID_MC:
+    case INDEX_ID_WO:
+    case INDEX_ID_SO:
+    case INDEX_ID_LA:
+    case INDEX_ID_VF:
+    case INDEX_ID_MA:
+    case INDEX_ID_TE:
+    case INDEX_ID_IM:
+    case INDEX_ID_NT:
+      return MAIN_FREE_PHASE_MAIN_THREAD;
+    case INDEX_ID_LI:
+    case INDEX_ID_IP:
+    case INDEX_ID_KE:
+    case INDEX_ID_PAL:
+    case INDEX_ID_GD:
+      return MAIN_FREE_PHASE_LAST;
+    default:
+      return MAIN_FREE_PHASE_PARALLEL;
+  }
+}
+
+typedef struct MainFreeListTaskData {
+  Main *main;
+  List *lb;
+  int free_flag;
+} MainFreeListTaskData;
+
+static void main_free_list(Main *mainvar, List *lb, const int free_flag)
+{
+  Id *id, *id_next;
+  for (id = lb->first; id != NULL; id = id_next) {
+    id_next = id->next;
+    id_free_ex(mainvar, id, free_flag, false);
+  }
+  lib_list_clear(lb);
+}
+
+static void main_free_list_task(TaskPool *__restrict UNUSED(pool), void *taskdata)
+{
+  MainFreeListTaskData *data = taskdata;
+  main_free_list(data->main, data->lb, data->free_flag);
+}
+
+/* Free all lists of given phase, in the same order as main_free. */
+static void main_free_lists_phase(Main *mainvar,
+                                  List *lbarray[INDEX_ID_MAX],
+                                  const eMainFreePhase phase,
+                                  const int free_flag,
+                                  const bool use_threading)
+{
+  TaskPool *task_pool = NULL;
+  if (use_threading && phase == MAIN_FREE_PHASE_PARALLEL) {
+    task_pool = lib_task_pool_create(NULL, TASK_PRIORITY_HIGH);
+  }
+
+  for (int a = INDEX_ID_MAX - 1; a--;) {
+    List *lb = lbarray[a];
+    if (main_free_phase_from_index(a) != phase || lib_list_is_empty(lb)) {
+      continue;
+    }
+    if (task_pool != NULL) {
+      MainFreeListTaskData *data = mem_mallocn(sizeof(*data), __func__);
+      data->main = mainvar;
+      data->lb = lb;
+      data->free_flag = free_flag;
+      lib_task_pool_push(task_pool, main_free_list_task, data, true, NULL);
+    }
+    else {
+      main_free_list(mainvar, lb, free_flag);
+    }
+  }
+
+  if (task_pool != NULL) {
+    lib_task_pool_work_and_wait(task_pool);
+    lib_task_pool_free(task_pool);
+  }
+}
+
+/* Free everything left once the Id lists are empty. */
+static void main_free_data(Main *mainvar)
+{
+  if (mainvar->relations) {
+    main_relations_free(mainvar);
+  }
+
+  if (mainvar->id_map) {
+    main_idmap_destroy(mainvar->id_map);
+  }
+
+  main_id_index_free(mainvar);
+
+  main_lock_free(mainvar->lock);
+  mem_freen(mainvar);
+}
+
+/* Mains passed to main_free_ex with MAIN_FREE_DEFERRED. The background pool only frees the types
+ * of the parallel phase, the last phase and the Main itself are freed on the main thread once that
+ * is done, see main_free_deferred_finish. Only accessed from the main thread. */
+static TaskPool *main_free_deferred_pool = NULL;
+static List main_free_deferred_mains = {NULL, NULL};
+
+typedef struct MainFreeDeferred {
+  struct MainFreeDeferred *next, *prev;
+  Main *main;
+  int free_flag;
+  bool use_threading;
+  /* Set from the background thread once the parallel phase is freed. */
+  int is_done;
+} MainFreeDeferred;
+
+static void main_free_deferred_task(TaskPool *__restrict UNUSED(pool), void *taskdata)
+{
+  MainFreeDeferred *deferred = taskdata;
+  List *lbarray[INDEX_ID_MAX];
+  set_listptrs(deferred->main, lbarray);
+
+  main_free_lists_phase(deferred->main,
+                        lbarray,
+                        MAIN_FREE_PHASE_PARALLEL,
+                        deferred->free_flag,
+                        deferred->use_threading);
+  atomic_add_and_fetch_int32(&deferred->is_done, 1);
+}
+
+/* Finish freeing the deferred Mains whose background part is done, optionally waiting for all of
+ * them. */
+static void main_free_deferred_finish(const bool wait)
+{
+  lib_assert(lib_thread_is_main());
+  if (main_free_deferred_pool == NULL) {
+    return;
+  }
+  if (wait) {
+    lib_task_pool_work_and_wait(main_free_deferred_pool);
+  }
+
+  LIST_FOREACH_MUTABLE (MainFreeDeferred *, deferred, &main_free_deferred_mains) {
+    if (atomic_load_int32(&deferred->is_done) == 0) {
+      continue;
+    }
+    List *lbarray[INDEX_ID_MAX];
+    set_listptrs(deferred->main, lbarray);
+    main_free_lists_phase(
+        deferred->main, lbarray, MAIN_FREE_PHASE_LAST, deferred->free_flag, false);
+    main_free_data(deferred->main);
+    lib_remlink(&main_free_deferred_mains, deferred);
+    mem_freen(deferred);
+  }
+
+  if (wait) {
+    lib_assert(lib_list_is_empty(&main_free_deferred_mains));
+    lib_task_pool_free(main_free_deferred_pool);
+    main_free_deferred_pool = NULL;
+  }
+}
+
+void main_free_ex(Main *mainvar, const int flag)
+{
+  if ((flag & (MAIN_FREE_THREADED | MAIN_FREE_DEFERRED)) == 0) {
+    main_free(mainvar);
+    return;
+  }
+
+  List *lbarray[INDEX_ID_MAX];
+  /* Same as main_free. */
+  const int free_flag = (LIB_ID_FREE_NO_MAIN | LIB_ID_FREE_NO_UI_USER |
+                         LIB_ID_FREE_NO_USER_REFCOUNT | LIB_ID_FREE_NO_DEG_TAG);
+  const bool use_threading = (flag & MAIN_FREE_THREADED) != 0;
+
+  /* The index would refer to freed Ids while the lists are freed. */
+  main_id_index_free(mainvar);
+  main_thumbnail_wait(mainvar);
+  MEM_SAFE_FREE(mainvar->tray_thumb);
+  set_listptrs(mainvar, lbarray);
+
+  main_free_lists_phase(mainvar, lbarray, MAIN_FREE_PHASE_UI, free_flag, false);
+  main_free_lists_phase(mainvar, lbarray, MAIN_FREE_PHASE_MAIN_THREAD, free_flag, false);
+
+  if (flag & MAIN_FREE_DEFERRED) {
+    lib_assert(lib_thread_is_main());
+    /* Reclaim previously deferred Mains that are done. */
+    main_free_deferred_finish(false);
+    if (main_free_deferred_pool == NULL) {
+      main_free_deferred_pool = lib_task_pool_create_background(NULL, TASK_PRIORITY_LOW);
+    }
+    MainFreeDeferred *deferred = mem_callocn(sizeof(*deferred), __func__);
+    deferred->main = mainvar;
+    deferred->free_flag = free_flag;
+    deferred->use_threading = use_threading;
+    lib_addtail(&main_free_deferred_mains, deferred);
+    lib_task_pool_push(main_free_deferred_pool, main_free_deferred_task, deferred, false, NULL);
+    return;
+  }
+
+  main_free_lists_phase(mainvar, lbarray, MAIN_FREE_PHASE_PARALLEL, free_flag, use_threading);
+  main_free_lists_phase(mainvar, lbarray, MAIN_FREE_PHASE_LAST, free_flag, false);
+  main_free_data(mainvar);
+}
+
+void main_free_deferred_wait(void)
+{
+  main_free_deferred_finish(true);
+}
+
+static void main_thumbnail_cache_free(void);
+
+void main_exit(void)
+{
+  main_free_deferred_wait();
+  main_thumbnail_cache_free();
+}
+
 void main_free(Main *mainvar)
 {
   /* also call when reading a file, erase all, etc */
@@ -40,6 +348,9 @@ void main_free(Main *mainvar)
   const int free_flag = (LIB_ID_FREE_NO_MAIN | LIB_ID_FREE_NO_UI_USER |
                          LIB_ID_FREE_NO_USER_REFCOUNT | LIB_ID_FREE_NO_DEG_TAG);
 
+  /* The index would refer to freed Ids while the lists are freed. */
+  main_id_index_free(mainvar);
+  main_thumbnail_wait(mainvar);
   MEM_SAFE_FREE(mainvar->tray_thumb);
 
   a = set_listpyrs(mainvar, lbarray);
@@ -169,17 +480,7 @@ void main_free(Main *mainvar)
     lib_list_clear(lb);
   }
 
-  if (mainvar->relations) {
-    main_relations_free(mainvar);
-  }
-
-  if (mainvar->id_map) {
-    main_idmap_destroy(mainvar->id_map);
-  }
-
-  lib_spin_end((SpinLock *)mainvar->lock);
-  mem_freen(mainvar->lock);
-  mem_freen(mainvar);
+  main_free_data(mainvar);
 }
 
 bool main_is_empty(struct Main *main)
@@ -194,12 +495,360 @@ bool main_is_empty(struct Main *main)
 
 void main_lock(struct Main *main)
 {
-  lib_spin_lock((SpinLock *)main->lock);
+  main_lock_rw_mutex_lock(main->lock, &main->lock->global, THREAD_LOCK_WRITE);
+  main->lock->global_write_start = lib_check_seconds_timer();
 }
 
 void main_unlock(struct Main *main)
 {
-  lib_spin_unlock((SpinLock *)main->lock);
+  main_lock_write_time_add(main->lock, main->lock->global_write_start);
+  lib_rw_mutex_unlock(&main->lock->global);
+}
+
+void main_lock_read(struct Main *main)
+{
+  struct MainLock *lock = main->lock;
+  main_lock_rw_mutex_lock(lock, &lock->global, THREAD_LOCK_READ);
+  for (int i = 0; i < INDEX_ID_MAX; i++) {
+    lib_rw_mutex_lock(&lock->shards[i], THREAD_LOCK_READ);
+  }
+}
+
+void main_unlock_read(struct Main *main)
+{
+  struct MainLock *lock = main->lock;
+  for (int i = INDEX_ID_MAX; i--;) {
+    lib_rw_mutex_unlock(&lock->shards[i]);
+  }
+  lib_rw_mutex_unlock(&lock->global);
+}
+
+void main_lock_type(struct Main *main, const short id_type, const bool write)
+{
+  struct MainLock *lock = main->lock;
+  const int index = idtype_idcode_to_index(id_type);
+  lib_assert(index >= 0);
+
+  lib_rw_mutex_lock(&lock->global, THREAD_LOCK_READ);
+  main_lock_rw_mutex_lock(
+      lock, &lock->shards[index], write ? THREAD_LOCK_WRITE : THREAD_LOCK_READ);
+  if (write) {
+    lock->shards_write[index] = true;
+    lock->shards_write_start[index] = lib_check_seconds_timer();
+  }
+}
+
+void main_unlock_type(struct Main *main, const short id_type)
+{
+  struct MainLock *lock = main->lock;
+  const int index = idtype_idcode_to_index(id_type);
+  lib_assert(index >= 0);
+
+  /* Only a writer can see its own flag set, readers exclude writers. */
+  if (lock->shards_write[index]) {
+    lock->shards_write[index] = false;
+    main_lock_write_time_add(lock, lock->shards_write_start[index]);
+  }
+  lib_rw_mutex_unlock(&lock->shards[index]);
+  lib_rw_mutex_unlock(&lock->global);
+}
+
+void main_lock_stats_get(const struct Main *main, MainLockStats *r_stats)
+{
+  const MainLockStats *stats = &main->lock->stats;
+  r_stats->read_acquired_num = atomic_load_uint64(&stats->read_acquired_num);
+  r_stats->write_acquired_num = atomic_load_uint64(&stats->write_acquired_num);
+  r_stats->contended_num = atomic_load_uint64(&stats->contended_num);
+  r_stats->wait_time_us = atomic_load_uint64(&stats->wait_time_us);
+  r_stats->write_hold_time_us = atomic_load_uint64(&stats->write_hold_time_us);
+}
+
+void main_lock_stats_reset(struct Main *main)
+{
+  MainLockStats *stats = &main->lock->stats;
+  atomic_store_uint64(&stats->read_acquired_num, 0);
+  atomic_store_uint64(&stats->write_acquired_num, 0);
+  atomic_store_uint64(&stats->contended_num, 0);
+  atomic_store_uint64(&stats->wait_time_us, 0);
+  atomic_store_uint64(&stats->write_hold_time_us, 0);
+}
+
+/* Check the Id index against the Main on each lookup, very slow. */
+// #define USE_IDMAP_DEBUG_VALIDATE
+
+static void main_id_uuid_index_ensure(Main *main);
+static void main_id_uuid_index_free(Main *main);
+
+void main_id_index_ensure(Main *main)
+{
+  if (main->id_index == NULL) {
+    main->id_index = main_idmap_create(main, false, NULL, MAIN_IDMAP_TYPE_NAME);
+    /* Lookups must never change the index, they may run from several threads. */
+    main_idmap_name_maps_ensure(main->id_index);
+  }
+  main_id_uuid_index_ensure(main);
+}
+
+void main_id_index_free(Main *main)
+{
+  if (main->id_index != NULL) {
+    main_idmap_destroy(main->id_index);
+    main->id_index = NULL;
+  }
+  main_id_uuid_index_free(main);
+}
+
+/* Session uuid index of a Main, see main_id_index_lookup_uuid.
+ *
+ * Session uuids come from a single global counter, so the Ids of a Main mostly have small and
+ * dense uuids, which are stored in an array indexed by uuid. Uuids too big compared to the amount
+ * of indexed Ids (e.g. after many Ids were created and freed again) go into a hash instead. */
+struct MainIdUuidIndex {
+  Id **dense;
+  uint dense_len;
+  uint ids_num;
+  /* Created on demand, uint uuid -> Id. */
+  GHash *sparse;
+};
+
+/* Smallest dense array size, and how much larger than the amount of Ids it may grow. */
+#define MAIN_ID_UUID_INDEX_DENSE_MIN 1024
+#define MAIN_ID_UUID_INDEX_DENSE_FACTOR 4
+
+static void main_id_uuid_index_add(struct MainIdUuidIndex *index, Id *id)
+{
+  const uint uuid = id->session_uuid;
+  lib_assert(uuid != MAIN_ID_SESSION_UUID_UNSET);
+
+  if (uuid >= index->dense_len &&
+      uuid < MAX2((index->ids_num + 1) * MAIN_ID_UUID_INDEX_DENSE_FACTOR,
+                  MAIN_ID_UUID_INDEX_DENSE_MIN))
+  {
+    const uint dense_len = power_of_2_max_u(uuid + 1);
+    index->dense = mem_reallocn(index->dense, sizeof(*index->dense) * dense_len);
+    memset(&index->dense[index->dense_len],
+           0,
+           sizeof(*index->dense) * (dense_len - index->dense_len));
+    index->dense_len = dense_len;
+  }
+
+  if (uuid < index->dense_len) {
+    lib_assert(index->dense[uuid] == NULL);
+    index->dense[uuid] = id;
+  }
+  else {
+    if (index->sparse == NULL) {
+      index->sparse = lib_ghash_int_new(__func__);
+    }
+    lib_ghash_insert(index->sparse, PTR_FROM_UINT(uuid), id);
+  }
+  index->ids_num++;
+}
+
+static void main_id_uuid_index_remove(struct MainIdUuidIndex *index, Id *id, const uint uuid)
+{
+  /* Entries may be in the hash even if their uuid is now covered by the dense array, since they
+   * are not moved when it grows. */
+  if (uuid < index->dense_len && index->dense[uuid] == id) {
+    index->dense[uuid] = NULL;
+    index->ids_num--;
+  }
+  else if (index->sparse != NULL &&
+           lib_ghash_remove(index->sparse, PTR_FROM_UINT(uuid), NULL, NULL))
+  {
+    index->ids_num--;
+  }
+}
+
+static Id *main_id_uuid_index_lookup(const struct MainIdUuidIndex *index, const uint uuid)
+{
+  if (uuid < index->dense_len && index->dense[uuid] != NULL) {
+    return index->dense[uuid];
+  }
+  return index->sparse != NULL ? lib_ghash_lookup(index->sparse, PTR_FROM_UINT(uuid)) : NULL;
+}
+
+#ifdef USE_IDMAP_DEBUG_VALIDATE
+static bool main_id_uuid_index_validate(Main *main)
+{
+  const struct MainIdUuidIndex *index = main->id_uuid_index;
+  uint ids_num = 0;
+  Id *id;
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    if (id->session_uuid == MAIN_ID_SESSION_UUID_UNSET) {
+      continue;
+    }
+    if (main_id_uuid_index_lookup(index, id->session_uuid) != id) {
+      return false;
+    }
+    ids_num++;
+  }
+  FOREACH_MAIN_ID_END;
+  return index->ids_num == ids_num;
+}
+#endif
+
+static void main_id_uuid_index_ensure(Main *main)
+{
+  if (main->id_uuid_index != NULL) {
+    return;
+  }
+  struct MainIdUuidIndex *index = mem_callocn(sizeof(*index), __func__);
+  index->dense_len = MAIN_ID_UUID_INDEX_DENSE_MIN;
+  index->dense = mem_callocn(sizeof(*index->dense) * index->dense_len, __func__);
+
+  Id *id;
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    if (id->session_uuid != MAIN_ID_SESSION_UUID_UNSET) {
+      main_id_uuid_index_add(index, id);
+    }
+  }
+  FOREACH_MAIN_ID_END;
+
+  main->id_uuid_index = index;
+}
+
+static void main_id_uuid_index_free(Main *main)
+{
+  struct MainIdUuidIndex *index = main->id_uuid_index;
+  if (index == NULL) {
+    return;
+  }
+  if (index->sparse != NULL) {
+    lib_ghash_free(index->sparse, NULL, NULL);
+  }
+  mem_freen(index->dense);
+  mem_freen(index);
+  main->id_uuid_index = NULL;
+}
+
+void main_id_index_add_id(Main *main, Id *id)
+{
+  if (main->id_index != NULL) {
+    main_idmap_insert_id(main->id_index, id);
+  }
+  if (main->id_uuid_index != NULL && id->session_uuid != MAIN_ID_SESSION_UUID_UNSET) {
+    main_id_uuid_index_add(main->id_uuid_index, id);
+  }
+}
+
+void main_id_index_remove_id(Main *main, Id *id)
+{
+  if (main->id_index != NULL) {
+    main_idmap_remove_id(main->id_index, id);
+  }
+  if (main->id_uuid_index != NULL && id->session_uuid != MAIN_ID_SESSION_UUID_UNSET) {
+    main_id_uuid_index_remove(main->id_uuid_index, id, id->session_uuid);
+  }
+}
+
+void main_id_index_update_uuid(Main *main, Id *id, const uint old_uuid)
+{
+  if (main->id_uuid_index == NULL || old_uuid == id->session_uuid) {
+    return;
+  }
+  if (old_uuid != MAIN_ID_SESSION_UUID_UNSET) {
+    main_id_uuid_index_remove(main->id_uuid_index, id, old_uuid);
+  }
+  if (id->session_uuid != MAIN_ID_SESSION_UUID_UNSET) {
+    main_id_uuid_index_add(main->id_uuid_index, id);
+  }
+}
+
+void main_id_index_rename_id(Main *main, Id *id, const char *old_name)
+{
+  if (main->id_index != NULL) {
+    main_idmap_rename_id(main->id_index, id, old_name);
+  }
+}
+
+Id *main_id_index_lookup_name(Main *main, const short type, const char *name, const Lib *lib)
+{
+  if (main->id_index == NULL) {
+    List *lb = which_lib(main, type);
+    if (lb == NULL) {
+      return NULL;
+    }
+    LIST_FOREACH (Id *, id, lb) {
+      if (id->lib == lib && STREQ(id->name + 2, name)) {
+        return id;
+      }
+    }
+    return NULL;
+  }
+#ifdef USE_IDMAP_DEBUG_VALIDATE
+  lib_assert(main_idmap_validate(main->id_index));
+#endif
+  return main_idmap_lookup_name(main->id_index, type, name, lib);
+}
+
+Id *main_id_index_lookup_uuid(Main *main, const uint session_uuid)
+{
+  if (session_uuid == MAIN_ID_SESSION_UUID_UNSET) {
+    return NULL;
+  }
+  if (main->id_uuid_index == NULL) {
+    Id *id;
+    FOREACH_MAIN_ID_BEGIN (main, id) {
+      if (id->session_uuid == session_uuid) {
+        return id;
+      }
+    }
+    FOREACH_MAIN_ID_END;
+    return NULL;
+  }
+#ifdef USE_IDMAP_DEBUG_VALIDATE
+  lib_assert(main_id_uuid_index_validate(main));
+#endif
+  return main_id_uuid_index_lookup(main->id_uuid_index, session_uuid);
+}
+
+/* Amount of entries per word of the tag bitmaps. */
+#define MAIN_RELATIONS_TAGS_WORD_BITS ((uint)(sizeof(LIB_bitmap) * 8))
+
+/* Grow the tag bitmaps so that they can store `len` entries. */
+static void main_relations_tags_reserve(MainIdRelations *main_relations, const uint len)
+{
+  if (len <= main_relations->entries_len_alloc) {
+    return;
+  }
+  main_relations->entries_len_alloc = MAX2(len, main_relations->entries_len_alloc * 2);
+  for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+    if (main_relations->tags_bitmaps[bit] != NULL) {
+      LIB_BITMAP_RESIZE(main_relations->tags_bitmaps[bit], main_relations->entries_len_alloc);
+    }
+  }
+}
+
+/* Ensure the relations entry of `id` exists, giving new ones the next dense index. */
+static MainIdRelationsEntry *main_relations_entry_ensure(MainIdRelations *main_relations, Id *id)
+{
+  MainIdRelationsEntry **entry_p;
+  if (!lib_ghash_ensure_p(main_relations->relations_from_ptrs, id, (void ***)&entry_p)) {
+    MainIdRelationsEntry *entry = mem_callocn(sizeof(*entry), __func__);
+    entry->session_uuid = id->session_uuid;
+    entry->index = main_relations->entries_num++;
+
+    if (main_relations->entries_num > main_relations->entries_len_alloc) {
+      main_relations_tags_reserve(main_relations, main_relations->entries_num);
+      main_relations->entries = mem_reallocn(
+          main_relations->entries,
+          sizeof(*main_relations->entries) * main_relations->entries_len_alloc);
+    }
+    main_relations->entries[entry->index] = entry;
+    *entry_p = entry;
+
+    /* New entries start untagged, whatever was left in the bitmaps at their index. */
+    for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+      if (main_relations->tags_bitmaps[bit] != NULL) {
+        LIB_BITMAP_DISABLE(main_relations->tags_bitmaps[bit], entry->index);
+      }
+    }
+  }
+  else {
+    lib_assert((*entry_p)->session_uuid == id->session_uuid);
+  }
+  return *entry_p;
 }
 
 static int main_relations_create_idlink_cb(LibIdLinkCbData *cb_data)
@@ -210,57 +859,324 @@ static int main_relations_create_idlink_cb(LibIdLinkCbData *cb_data)
   const int cb_flag = cb_data->cb_flag;
 
   if (*id_ptr) {
-    MainIdRelationsEntry **entry_p;
+    MainIdRelationsEntry *entry;
 
     /* Add `id_ptr` as child of `id_self`. */
     {
-      if (!lib_ghash_ensure_p(
-              main_relations->relations_from_ptrs, id_self, (void ***)&entry_p)) {
-        *entry_p = mem_callocn(sizeof(**entry_p), __func__);
-        (*entry_p)->session_uuid = id_self->session_uuid;
-      }
-      else {
-        lib_assert((*entry_p)->session_uuid == id_self->session_uuid);
-      }
+      entry = main_relations_entry_ensure(main_relations, id_self);
       MainIdRelationsEntryItem *to_id_entry = lib_mempool_alloc(main_relations->entry_items_pool);
-      to_id_entry->next = (*entry_p)->to_ids;
+      to_id_entry->next = entry->to_ids;
       to_id_entry->id_ptr.to = id_ptr;
       to_id_entry->session_uuid = (*id_ptr != NULL) ? (*id_ptr)->session_uuid :
                                                           MAIN_ID_SESSION_UUID_UNSET;
       to_id_entry->usage_flag = cb_flag;
-      (*entry_p)->to_ids = to_id_entry;
+      entry->to_ids = to_id_entry;
     }
 
     /* Add `id_self` as parent of `id_ptr`. */
     if (*id_ptr != NULL) {
-      if (!lib_ghash_ensure_p(
-              main_relations->relations_from_ptrs, *id_ptr, (void ***)&entry_p)) {
-        *entry_p = mem_callocn(sizeof(**entry_p), __func__);
-        (*entry_p)->session_uuid = (*id_ptr)->session_uuid;
-      }
-      else {
-        lib_assert((*entry_p)->session_uuid == (*id_ptr)->session_uuid);
-      }
+      entry = main_relations_entry_ensure(main_relations, *id_ptr);
       MainIdRelationsEntryItem *from_id_entry = lib_mempool_alloc(
       main_relations->entry_items_pool);
-      from_id_entry->next = (*entry_p)->from_ids;
+      from_id_entry->next = entry->from_ids;
       from_id_entry->id_ptr.from = id_self;
       from_id_entry->session_uuid = id_self->session_uuid;
       from_id_entry->usage_flag = cb_flag;
-      (*entry_p)->from_ids = from_id_entry;
+      entry->from_ids = from_id_entry;
     }
   }
 
   return IDWALK_RET_NOP;
 }
 
+/* Edge gathered while walking Ids, before being sorted into the compact arrays. */
+typedef struct MainRelationsCompactBuildEdge {
+  uint from_index;
+  uint to_index;
+  Id **id_ptr;
+  int usage_flag;
+} MainRelationsCompactBuildEdge;
+
+/* Thread-local buffer of gathered edges. */
+typedef struct MainRelationsCompactEdgeBuffer {
+  MainRelationsCompactBuildEdge *edges;
+  uint edges_num;
+  uint edges_len_alloc;
+} MainRelationsCompactEdgeBuffer;
+
+typedef struct MainRelationsCompactBuildData {
+  const MainIdRelationsCompact *relations;
+  uint id_index;
+  MainRelationsCompactEdgeBuffer *buffer;
+} MainRelationsCompactBuildData;
+
+/* Below that amount of Ids, the relations are built on a single thread. */
+#define MAIN_RELATIONS_PARALLEL_IDS_MIN 1024
+
+static void main_relations_compact_edge_buffer_reserve(MainRelationsCompactEdgeBuffer *buffer,
+                                                       const uint edges_num)
+{
+  if (buffer->edges_num + edges_num > buffer->edges_len_alloc) {
+    buffer->edges_len_alloc = MAX3(
+        buffer->edges_len_alloc * 2, buffer->edges_num + edges_num, (uint)1024);
+    buffer->edges = mem_reallocn(buffer->edges, sizeof(*buffer->edges) * buffer->edges_len_alloc);
+  }
+}
+
+static int main_relations_compact_create_idlink_cb(LibIdLinkCbData *cb_data)
+{
+  MainRelationsCompactBuildData *data = cb_data->user_data;
+  Id **id_ptr = cb_data->id_ptr;
+
+  if (*id_ptr) {
+    MainRelationsCompactEdgeBuffer *buffer = data->buffer;
+    main_relations_compact_edge_buffer_reserve(buffer, 1);
+    MainRelationsCompactBuildEdge *edge = &buffer->edges[buffer->edges_num++];
+    edge->from_index = data->id_index;
+    /* Read-only GHash lookups are thread-safe. */
+    edge->to_index = main_relations_compact_index(data->relations, *id_ptr);
+    edge->id_ptr = id_ptr;
+    edge->usage_flag = cb_data->cb_flag;
+  }
+
+  return IDWALK_RET_NOP;
+}
+
+typedef struct MainRelationsCompactGatherData {
+  const MainIdRelationsCompact *relations;
+  int idwalk_flag;
+  /* Buffer all edges end up in, owned by main_relations_compact_create. */
+  const MainRelationsCompactEdgeBuffer *buffer_join;
+} MainRelationsCompactGatherData;
+
+static void main_relations_compact_gather_fn(void *__restrict userdata,
+                                             const int iter,
+                                             const TaskParallelTLS *__restrict tls)
+{
+  const MainRelationsCompactGatherData *gather_data = userdata;
+  MainRelationsCompactBuildData data = {
+      .relations = gather_data->relations,
+      .id_index = (uint)iter,
+      .buffer = tls->userdata_chunk,
+  };
+  lib_foreach_id_link(NULL,
+                      gather_data->relations->ids[iter],
+                      main_relations_compact_create_idlink_cb,
+                      &data,
+                      gather_data->idwalk_flag);
+}
+
+/* Moves the edges of `chunk` into `chunk_join`, leaving `chunk` empty. */
+static void main_relations_compact_gather_reduce(const void *__restrict UNUSED(userdata),
+                                                 void *__restrict chunk_join,
+                                                 void *__restrict chunk)
+{
+  MainRelationsCompactEdgeBuffer *buffer_join = chunk_join;
+  MainRelationsCompactEdgeBuffer *buffer = chunk;
+  if (buffer == buffer_join || buffer->edges == buffer_join->edges) {
+    return;
+  }
+  if (buffer_join->edges == NULL) {
+    *buffer_join = *buffer;
+  }
+  else if (buffer->edges_num != 0) {
+    main_relations_compact_edge_buffer_reserve(buffer_join, buffer->edges_num);
+    memcpy(&buffer_join->edges[buffer_join->edges_num],
+           buffer->edges,
+           sizeof(*buffer->edges) * buffer->edges_num);
+    buffer_join->edges_num += buffer->edges_num;
+    mem_freen(buffer->edges);
+  }
+  else {
+    MEM_SAFE_FREE(buffer->edges);
+  }
+  buffer->edges = NULL;
+  buffer->edges_num = 0;
+  buffer->edges_len_alloc = 0;
+}
+
+/* Only frees task buffers which were not reduced. The join buffer, which the single-threaded
+ * path fills directly, and edges it took over, are freed by main_relations_compact_create. */
+static void main_relations_compact_gather_free(const void *__restrict userdata,
+                                               void *__restrict chunk)
+{
+  const MainRelationsCompactGatherData *gather_data = userdata;
+  MainRelationsCompactEdgeBuffer *buffer = chunk;
+  if (buffer == gather_data->buffer_join || buffer->edges == gather_data->buffer_join->edges) {
+    return;
+  }
+  MEM_SAFE_FREE(buffer->edges);
+}
+
+static void main_relations_compact_create(Main *main, MainIdRelationsCompact *relations)
+{
+  const int idwalk_flag = IDWALK_READONLY |
+                          ((main->relations->flag & MAINIDRELATIONS_INCLUDE_UI) != 0 ?
+                               IDWALK_INCLUDE_UI :
+                               0);
+  Id *id;
+
+  /* Dense indices. */
+  uint ids_num = 0;
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    ids_num++;
+  }
+  FOREACH_MAIN_ID_END;
+
+  relations->ids_num = ids_num;
+  relations->ids = mem_mallocn(sizeof(*relations->ids) * MAX2(ids_num, 1), __func__);
+  relations->session_uuids = mem_mallocn(sizeof(*relations->session_uuids) * MAX2(ids_num, 1),
+                                         __func__);
+  relations->index_from_ptrs = lib_ghash_new_ex(
+      lib_ghashutil_ptrhash, lib_ghashutil_ptrcmp, __func__, ids_num);
+
+  uint index = 0;
+  FOREACH_MAIN_ID_BEGIN (main, id) {
+    relations->ids[index] = id;
+    relations->session_uuids[index] = id->session_uuid;
+    lib_ghash_insert(relations->index_from_ptrs, id, PTR_FROM_UINT(index));
+    index++;
+  }
+  FOREACH_MAIN_ID_END;
+
+  /* Gather all edges, walking Ids from worker threads into thread-local buffers which are then
+   * concatenated. Their order is arbitrary, the counting sort below groups them by Id. */
+  MainRelationsCompactEdgeBuffer buffer = {NULL};
+  MainRelationsCompactGatherData gather_data = {
+      .relations = relations, .idwalk_flag = idwalk_flag, .buffer_join = &buffer};
+  TaskParallelSettings settings;
+  lib_parallel_range_settings_defaults(&settings);
+  settings.use_threading = ids_num >= MAIN_RELATIONS_PARALLEL_IDS_MIN;
+  settings.min_iter_per_thread = 64;
+  settings.userdata_chunk = &buffer;
+  settings.userdata_chunk_size = sizeof(buffer);
+  settings.func_reduce = main_relations_compact_gather_reduce;
+  settings.func_free = main_relations_compact_gather_free;
+  lib_task_parallel_range(
+      0, (int)ids_num, &gather_data, main_relations_compact_gather_fn, &settings);
+
+  const uint edges_num = buffer.edges_num;
+  const MainRelationsCompactBuildEdge *edges = buffer.edges;
+  relations->edges_num = edges_num;
+  relations->to_offsets = mem_callocn(sizeof(*relations->to_offsets) * (ids_num + 1), __func__);
+  relations->from_offsets = mem_callocn(sizeof(*relations->from_offsets) * (ids_num + 1),
+                                        __func__);
+  relations->to_edges = mem_mallocn(sizeof(*relations->to_edges) * MAX2(edges_num, 1), __func__);
+  relations->to_id_ptrs = mem_mallocn(sizeof(*relations->to_id_ptrs) * MAX2(edges_num, 1),
+                                      __func__);
+  relations->from_edges = mem_mallocn(sizeof(*relations->from_edges) * MAX2(edges_num, 1),
+                                      __func__);
+
+  /* First pass: count edges of each Id, and turn the counts into offsets. */
+  for (uint i = 0; i < edges_num; i++) {
+    const MainRelationsCompactBuildEdge *edge = &edges[i];
+    relations->to_offsets[edge->from_index + 1]++;
+    if (edge->to_index != MAINIDRELATIONS_INDEX_NONE) {
+      relations->from_offsets[edge->to_index + 1]++;
+    }
+  }
+  for (uint i = 0; i < ids_num; i++) {
+    relations->to_offsets[i + 1] += relations->to_offsets[i];
+    relations->from_offsets[i + 1] += relations->from_offsets[i];
+  }
+
+  /* Second pass: fill the `to` arrays, using the offsets of each Id as insertion cursors. Edges of
+   * a same Id were all gathered by the same thread, so they keep their walking order. */
+  uint *cursors = mem_mallocn(sizeof(*cursors) * MAX2(ids_num, 1), __func__);
+  memcpy(cursors, relations->to_offsets, sizeof(*cursors) * ids_num);
+  for (uint i = 0; i < edges_num; i++) {
+    const MainRelationsCompactBuildEdge *edge = &edges[i];
+    const uint edge_index = cursors[edge->from_index]++;
+    MainIdRelationsCompactEdge *to_edge = &relations->to_edges[edge_index];
+    to_edge->id_index = edge->to_index;
+    to_edge->session_uuid = (*edge->id_ptr)->session_uuid;
+    to_edge->usage_flag = edge->usage_flag;
+    relations->to_id_ptrs[edge_index] = edge->id_ptr;
+  }
+
+  /* The `from` arrays are filled from the sorted `to` ones, so that their order does not depend
+   * on how work was split between threads. */
+  memcpy(cursors, relations->from_offsets, sizeof(*cursors) * ids_num);
+  for (uint from_index = 0; from_index < ids_num; from_index++) {
+    for (uint i = relations->to_offsets[from_index]; i < relations->to_offsets[from_index + 1];
+         i++)
+    {
+      const MainIdRelationsCompactEdge *to_edge = &relations->to_edges[i];
+      if (to_edge->id_index != MAINIDRELATIONS_INDEX_NONE) {
+        MainIdRelationsCompactEdge *from_edge =
+            &relations->from_edges[cursors[to_edge->id_index]++];
+        from_edge->id_index = from_index;
+        from_edge->session_uuid = relations->session_uuids[from_index];
+        from_edge->usage_flag = to_edge->usage_flag;
+      }
+    }
+  }
+
+  mem_freen(cursors);
+  MEM_SAFE_FREE(buffer.edges);
+}
+
+static void main_relations_compact_free(MainIdRelationsCompact *relations)
+{
+  lib_ghash_free(relations->index_from_ptrs, NULL, NULL);
+  mem_freen(relations->ids);
+  mem_freen(relations->session_uuids);
+  mem_freen(relations->to_offsets);
+  mem_freen(relations->from_offsets);
+  mem_freen(relations->to_edges);
+  mem_freen(relations->to_id_ptrs);
+  mem_freen(relations->from_edges);
+  mem_freen(relations);
+}
+
+uint main_relations_compact_index(const MainIdRelationsCompact *relations, const Id *id)
+{
+  void **index_p = lib_ghash_lookup_p(relations->index_from_ptrs, id);
+  return index_p != NULL ? PTR_AS_UINT(*index_p) : MAINIDRELATIONS_INDEX_NONE;
+}
+
+uint main_relations_compact_to_ids(const MainIdRelationsCompact *relations,
+                                   const uint index,
+                                   const MainIdRelationsCompactEdge **r_edges,
+                                   Id ****r_id_ptrs)
+{
+  lib_assert(index < relations->ids_num);
+  const uint offset = relations->to_offsets[index];
+  *r_edges = &relations->to_edges[offset];
+  if (r_id_ptrs != NULL) {
+    *r_id_ptrs = &relations->to_id_ptrs[offset];
+  }
+  return relations->to_offsets[index + 1] - offset;
+}
+
+uint main_relations_compact_from_ids(const MainIdRelationsCompact *relations,
+                                     const uint index,
+                                     const MainIdRelationsCompactEdge **r_edges)
+{
+  lib_assert(index < relations->ids_num);
+  const uint offset = relations->from_offsets[index];
+  *r_edges = &relations->from_edges[offset];
+  return relations->from_offsets[index + 1] - offset;
+}
+
 void main_relations_create(Main *main, const short flag)
 {
   if (main->relations != NULL) {
     main_relations_free(main);
   }
+  main->relations_generation++;
+
+  if (flag & MAINIDRELATIONS_COMPACT) {
+    main->relations = mem_callocn(sizeof(*main->relations), __func__);
+    main->relations->flag = flag;
+    main->relations->compact = mem_callocn(sizeof(*main->relations->compact), __func__);
+    main_relations_compact_create(main, main->relations->compact);
+    main->relations->entries_num = main->relations->compact->ids_num;
+    main_relations_tags_reserve(main->relations, main->relations->entries_num);
+    return;
+  }
 
-  main->relations = mem_mallocn(sizeof(*main->relations), __func__);
+  main->relations = mem_callocn(sizeof(*main->relations), __func__);
   main->relations->relations_from_ptrs = lib_ghash_new(
       lib_ghashutil_ptrhash, lib_ghashutil_ptrcmp, __func__);
   main->relations->entry_items_pool = lib_mempool_create(
@@ -274,14 +1190,7 @@ void main_relations_create(Main *main, const short flag)
                             ((flag & MAINIDRELATIONS_INCLUDE_UI) != 0 ? IDWALK_INCLUDE_UI : 0);
 
     /* Ensure all Ids do have an entry, even if they are not connected to any other. */
-    MainIdRelationsEntry **entry_p;
-    if (!lib_ghash_ensure_p(main->relations->relations_from_ptrs, id, (void ***)&entry_p)) {
-      *entry_p = mem_callocn(sizeof(**entry_p), __func__);
-      (*entry_p)->session_uuid = id->session_uuid;
-    }
-    else {
-      lib_assert((*entry_p)->session_uuid == id->session_uuid);
-    }
+    main_relations_entry_ensure(main->relations, id);
 
     lib_foreach_id_link(
         NULL, id, main_relations_create_idlink_cb, main->relations, idwalk_flag);
@@ -289,15 +1198,186 @@ void main_relations_create(Main *main, const short flag)
   FOREACH_MAIN_ID_END;
 }
 
+/* Unlink and free the first item of `items_p` list matching `id_from` (for `from_ids` lists), or
+ * `id_ptr` (for `to_ids` lists). */
+static bool main_relations_entry_item_remove(MainIdRelations *main_relations,
+                                             MainIdRelationsEntryItem **items_p,
+                                             const Id *id_from,
+                                             Id **id_ptr)
+{
+  for (; *items_p != NULL; items_p = &(*items_p)->next) {
+    MainIdRelationsEntryItem *item = *items_p;
+    if ((id_ptr != NULL) ? (item->id_ptr.to == id_ptr) : (item->id_ptr.from == id_from)) {
+      *items_p = item->next;
+      lib_mempool_free(main_relations->entry_items_pool, item);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool main_relations_is_incremental(Main *main)
+{
+  if (main->relations == NULL) {
+    return false;
+  }
+  if (main->relations->compact != NULL) {
+    /* The compact relations cannot be updated in place. They are kept, so that code still
+     * reading them does not access freed memory, but flagged so that it re-generates them. */
+    main->relations->compact->is_outdated = true;
+    main->relations_generation++;
+    return false;
+  }
+  return true;
+}
+
+void main_relations_id_add(Main *main, Id *id)
+{
+  if (!main_relations_is_incremental(main)) {
+    return;
+  }
+
+  const short flag = main->relations->flag;
+  const int idwalk_flag = IDWALK_READONLY |
+                          ((flag & MAINIDRELATIONS_INCLUDE_UI) != 0 ? IDWALK_INCLUDE_UI : 0);
+  main_relations_entry_ensure(main->relations, id);
+  lib_foreach_id_link(NULL, id, main_relations_create_idlink_cb, main->relations, idwalk_flag);
+  main->relations_generation++;
+}
+
+void main_relations_id_remove(Main *main, Id *id)
+{
+  if (main->relations != NULL && main->relations->compact != NULL) {
+    /* Keep the dense index of `id`, but never give access to it again. */
+    MainIdRelationsCompact *compact = main->relations->compact;
+    const uint index = main_relations_compact_index(compact, id);
+    if (index != MAINIDRELATIONS_INDEX_NONE) {
+      compact->ids[index] = NULL;
+      lib_ghash_remove(compact->index_from_ptrs, id, NULL, NULL);
+    }
+  }
+  if (!main_relations_is_incremental(main)) {
+    return;
+  }
+
+  MainIdRelationsEntry *entry = lib_ghash_popkey(main->relations->relations_from_ptrs, id, NULL);
+  if (entry == NULL) {
+    return;
+  }
+
+  /* Ids used by `id` lose it as user. */
+  for (MainIdRelationsEntryItem *item = entry->to_ids, *item_next; item != NULL; item = item_next)
+  {
+    item_next = item->next;
+    if (*item->id_ptr.to != NULL && *item->id_ptr.to != id) {
+      MainIdRelationsEntry *to_entry = lib_ghash_lookup(main->relations->relations_from_ptrs,
+                                                        *item->id_ptr.to);
+      if (to_entry != NULL) {
+        main_relations_entry_item_remove(main->relations, &to_entry->from_ids, id, NULL);
+      }
+    }
+    lib_mempool_free(main->relations->entry_items_pool, item);
+  }
+
+  /* Users of `id` lose their `to` items pointing to it. A user may reference `id` several
+   * times, each from item matches one to item. */
+  for (MainIdRelationsEntryItem *item = entry->from_ids, *item_next; item != NULL;
+       item = item_next)
+  {
+    item_next = item->next;
+    MainIdRelationsEntry *from_entry = lib_ghash_lookup(main->relations->relations_from_ptrs,
+                                                        item->id_ptr.from);
+    if (from_entry != NULL) {
+      for (MainIdRelationsEntryItem **to_p = &from_entry->to_ids; *to_p != NULL;
+           to_p = &(*to_p)->next)
+      {
+        MainIdRelationsEntryItem *to_item = *to_p;
+        if (*to_item->id_ptr.to == id) {
+          *to_p = to_item->next;
+          lib_mempool_free(main->relations->entry_items_pool, to_item);
+          break;
+        }
+      }
+    }
+    lib_mempool_free(main->relations->entry_items_pool, item);
+  }
+
+  /* Keep dense indices contiguous, moving the last entry (and its tags) into the freed one. */
+  MainIdRelations *main_relations = main->relations;
+  const uint last_index = --main_relations->entries_num;
+  if (entry->index != last_index) {
+    MainIdRelationsEntry *last_entry = main_relations->entries[last_index];
+    for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+      LIB_bitmap *bitmap = main_relations->tags_bitmaps[bit];
+      if (bitmap != NULL) {
+        LIB_BITMAP_SET(bitmap, entry->index, LIB_BITMAP_TEST_BOOL(bitmap, last_index));
+      }
+    }
+    last_entry->index = entry->index;
+    main_relations->entries[entry->index] = last_entry;
+  }
+  for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+    if (main_relations->tags_bitmaps[bit] != NULL) {
+      LIB_BITMAP_DISABLE(main_relations->tags_bitmaps[bit], last_index);
+    }
+  }
+
+  mem_freen(entry);
+  main->relations_generation++;
+}
+
+void main_relations_id_remap(Main *main, Id *id_self, Id **id_ptr, Id *old_id, const int cb_flag)
+{
+  if (!main_relations_is_incremental(main) || *id_ptr == old_id) {
+    return;
+  }
+
+  MainIdRelations *main_relations = main->relations;
+  MainIdRelationsEntry *entry = main_relations_entry_ensure(main_relations, id_self);
+
+  if (old_id != NULL) {
+    main_relations_entry_item_remove(main_relations, &entry->to_ids, NULL, id_ptr);
+    MainIdRelationsEntry *old_entry = lib_ghash_lookup(main_relations->relations_from_ptrs,
+                                                       old_id);
+    if (old_entry != NULL) {
+      main_relations_entry_item_remove(main_relations, &old_entry->from_ids, id_self, NULL);
+    }
+  }
+
+  if (*id_ptr != NULL) {
+    /* Same as when generating the relations, see main_relations_create_idlink_cb. */
+    LibIdLinkCbData cb_data = {
+        .user_data = main_relations, .id_self = id_self, .id_ptr = id_ptr, .cb_flag = cb_flag};
+    main_relations_create_idlink_cb(&cb_data);
+  }
+
+  main->relations_generation++;
+}
+
+uint main_relations_generation_get(const Main *main)
+{
+  return main->relations_generation;
+}
+
 void main_relations_free(Main *main)
 {
   if (main->relations != NULL) {
     if (main->relations->relations_from_ptrs != NULL) {
       lib_ghash_free(main->relations->relations_from_ptrs, NULL, mem_freen);
     }
-    lib_mempool_destroy(main->relations->entry_items_pool);
+    if (main->relations->compact != NULL) {
+      main_relations_compact_free(main->relations->compact);
+    }
+    if (main->relations->entry_items_pool != NULL) {
+      lib_mempool_destroy(main->relations->entry_items_pool);
+    }
+    MEM_SAFE_FREE(main->relations->entries);
+    for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+      MEM_SAFE_FREE(main->relations->tags_bitmaps[bit]);
+    }
     mem_freen(main->relations);
     main->relations = NULL;
+    main->relations_generation++;
   }
 }
 
@@ -309,19 +1389,82 @@ void main_relations_tag_set(struct Main *main,
     return;
   }
 
-  GHashIter *gh_iter;
-  for (gh_iter = lib_ghashIterator_new(main->relations->relations_from_ptrs);
-       !lib_ghashIter_done(gh_iter));
-       lib_ghashIter_step(gh_iter)) {
-    MainIdRelationsEntry *entry = lib_ghashIter_getValue(gh_iter);
-    if (value) {
-      entry->tags |= tag;
+  MainIdRelations *main_relations = main->relations;
+  for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+    if ((tag & (1u << bit)) == 0) {
+      continue;
     }
-    else {
-      entry->tags &= ~tag;
+    if (main_relations->tags_bitmaps[bit] == NULL) {
+      if (!value) {
+        continue;
+      }
+      main_relations->tags_bitmaps[bit] = LIB_BITMAP_NEW(main_relations->entries_len_alloc,
+                                                         __func__);
+    }
+    /* Only up to `entries_num` (rounded up to a whole word), entries created later must start
+     * untagged. */
+    lib_bitmap_set_all(main_relations->tags_bitmaps[bit], value, main_relations->entries_num);
+  }
+}
+
+bool main_relations_index_tag_test(const MainIdRelations *relations,
+                                   const uint index,
+                                   const eMainIdRelationsEntryTags tag)
+{
+  lib_assert(index < relations->entries_num);
+  for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+    const LIB_bitmap *bitmap = relations->tags_bitmaps[bit];
+    if ((tag & (1u << bit)) && bitmap != NULL && LIB_BITMAP_TEST(bitmap, index)) {
+      return true;
     }
   }
-  lib_ghashIter_free(gh_iter);
+  return false;
+}
+
+void main_relations_index_tag_set(MainIdRelations *relations,
+                                  const uint index,
+                                  const eMainIdRelationsEntryTags tag,
+                                  const bool value)
+{
+  lib_assert(index < relations->entries_num);
+  for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+    if ((tag & (1u << bit)) == 0) {
+      continue;
+    }
+    if (relations->tags_bitmaps[bit] == NULL) {
+      if (!value) {
+        continue;
+      }
+      relations->tags_bitmaps[bit] = LIB_BITMAP_NEW(relations->entries_len_alloc, __func__);
+    }
+    LIB_BITMAP_SET(relations->tags_bitmaps[bit], index, value);
+  }
+}
+
+uint main_relations_tag_find_next(const MainIdRelations *relations,
+                                  const eMainIdRelationsEntryTags tag,
+                                  uint index)
+{
+  const uint words_num = LIB_BITMAP_SIZE(relations->entries_num) / sizeof(LIB_bitmap);
+  const uint index_word = index / MAIN_RELATIONS_TAGS_WORD_BITS;
+  for (uint word_index = index_word; word_index < words_num; word_index++) {
+    /* Combine the words of all bits of `tag`. */
+    LIB_bitmap word = 0;
+    for (int bit = 0; bit < MAINIDRELATIONS_ENTRY_TAGS_BITS; bit++) {
+      if ((tag & (1u << bit)) && relations->tags_bitmaps[bit] != NULL) {
+        word |= relations->tags_bitmaps[bit][word_index];
+      }
+    }
+    /* Ignore bits before `index` in its word. */
+    if (word_index == index_word) {
+      word &= ~(LIB_bitmap)0 << (index % MAIN_RELATIONS_TAGS_WORD_BITS);
+    }
+    if (word != 0) {
+      const uint found = word_index * MAIN_RELATIONS_TAGS_WORD_BITS + bitscan_forward_uint(word);
+      return found < relations->entries_num ? found : MAINIDRELATIONS_INDEX_NONE;
+    }
+  }
+  return MAINIDRELATIONS_INDEX_NONE;
 }
 
 GSet *main_gset_create(Main *main, GSet *gset)
@@ -338,44 +1481,238 @@ GSet *main_gset_create(Main *main, GSet *gset)
   return gset;
 }
 
-/* Utils for Id's lib weak ref API */
-typedef struct LibWeakRefKey {
-  char filepath[FILE_MAX];
-  char id_name[MAX_ID_NAME];
-} LibWeakRefKey;
+/* Utils for Id's lib weak ref API
+ *
+ * Lib file paths and Id names are interned once into strings with a cached hash, and referred to
+ * by integer handles. The mapping itself is a flat open-addressing table keyed by a pair of
+ * handles, so appending many Ids from the same lib only hashes its path once. */
+
+/* Minimal amount of slots of the mapping tables, must be a power of two. */
+#define LIB_WEAK_REF_SLOTS_MIN 64
+
+/* Marks a mapping slot whose item has been removed, probing must continue past it. */
+#define LIB_WEAK_REF_SLOT_REMOVED ((Id *)(uintptr_t)1)
+
+typedef struct LibWeakRefString {
+  const char *str;
+  uint hash;
+} LibWeakRefString;
+
+typedef struct LibWeakRefSlot {
+  uint filepath;
+  uint id_name;
+  /* NULL for empty slots, LIB_WEAK_REF_SLOT_REMOVED for removed ones. */
+  Id *id;
+} LibWeakRefSlot;
+
+struct LibWeakRefMapping {
+  /* Interned strings, by handle. */
+  LibWeakRefString *strings;
+  uint strings_num;
+  uint strings_len_alloc;
+  /* Hash set of interned strings, storing `handle + 1` (0 for empty slots). */
+  uint *string_slots;
+  uint string_slots_mask;
+  /* Storage of the interned strings. */
+  struct MemArena *strings_arena;
+
+  /* The (lib file path, Id name) handles to local Id mapping. */
+  LibWeakRefSlot *slots;
+  uint slots_mask;
+  uint used_num;
+  uint removed_num;
+};
+
+static uint lib_weak_ref_string_find_ex(const LibWeakRefMapping *mapping,
+                                        const char *str,
+                                        const uint hash,
+                                        uint *r_slot_index)
+{
+  uint i = hash & mapping->string_slots_mask;
+  for (; mapping->string_slots[i] != 0; i = (i + 1) & mapping->string_slots_mask) {
+    const LibWeakRefString *string = &mapping->strings[mapping->string_slots[i] - 1];
+    if (string->hash == hash && STREQ(string->str, str)) {
+      break;
+    }
+  }
+  if (r_slot_index != NULL) {
+    *r_slot_index = i;
+  }
+  return mapping->string_slots[i] != 0 ? mapping->string_slots[i] - 1 : LIB_WEAK_REF_HANDLE_NONE;
+}
+
+static void lib_weak_ref_string_slots_alloc(LibWeakRefMapping *mapping, const uint slots_num)
+{
+  MEM_SAFE_FREE(mapping->string_slots);
+  mapping->string_slots = mem_callocn(sizeof(*mapping->string_slots) * slots_num, __func__);
+  mapping->string_slots_mask = slots_num - 1;
+  for (uint handle = 0; handle < mapping->strings_num; handle++) {
+    uint i = mapping->strings[handle].hash & mapping->string_slots_mask;
+    while (mapping->string_slots[i] != 0) {
+      i = (i + 1) & mapping->string_slots_mask;
+    }
+    mapping->string_slots[i] = handle + 1;
+  }
+}
 
-static LibWeakRefKey *lib_weak_key_create(LibWeakRefKey *key,
-                                          const char *lib_path,
-                                          const char *id_name)
+/* Return `str` truncated like when copied into a `str_maxncpy` sized buffer (as the weak ref of
+ * the Id stores it), using `buf` if needed. */
+static const char *lib_weak_ref_string_truncate(const char *str,
+                                                const size_t str_maxncpy,
+                                                char buf[FILE_MAX])
 {
-  if (key == NULL) {
-    key = mem_mallocn(sizeof(*key), __func__);
+  lib_assert(str_maxncpy <= FILE_MAX);
+  if (lib_strnlen(str, str_maxncpy) < str_maxncpy) {
+    return str;
+  }
+  lib_strncpy(buf, str, str_maxncpy);
+  return buf;
+}
+
+uint main_lib_weak_ref_string_find(const LibWeakRefMapping *mapping,
+                                   const char *str,
+                                   const size_t str_maxncpy)
+{
+  char buf[FILE_MAX];
+  str = lib_weak_ref_string_truncate(str, str_maxncpy, buf);
+  return lib_weak_ref_string_find_ex(
+      mapping, str, lib_ghashutil_strhash_p_murmur(str), NULL);
+}
+
+uint main_lib_weak_ref_string_ensure(LibWeakRefMapping *mapping,
+                                     const char *str,
+                                     const size_t str_maxncpy)
+{
+  char buf[FILE_MAX];
+  str = lib_weak_ref_string_truncate(str, str_maxncpy, buf);
+  const uint hash = lib_ghashutil_strhash_p_murmur(str);
+  uint slot_index;
+  const uint handle = lib_weak_ref_string_find_ex(mapping, str, hash, &slot_index);
+  if (handle != LIB_WEAK_REF_HANDLE_NONE) {
+    return handle;
+  }
+
+  if (mapping->strings_num == mapping->strings_len_alloc) {
+    mapping->strings_len_alloc = MAX2(mapping->strings_len_alloc * 2, 16);
+    mapping->strings = mem_reallocn(mapping->strings,
+                                    sizeof(*mapping->strings) * mapping->strings_len_alloc);
+  }
+  const uint new_handle = mapping->strings_num++;
+  mapping->strings[new_handle].str = lib_memarena_strdup(mapping->strings_arena, str);
+  mapping->strings[new_handle].hash = hash;
+  mapping->string_slots[slot_index] = new_handle + 1;
+
+  /* Keep the load factor at or below one half. */
+  if (mapping->strings_num * 2 > mapping->string_slots_mask + 1) {
+    lib_weak_ref_string_slots_alloc(mapping, (mapping->string_slots_mask + 1) * 2);
+  }
+  return new_handle;
+}
+
+static uint lib_weak_ref_slot_hash(const LibWeakRefMapping *mapping,
+                                   const uint filepath,
+                                   const uint id_name)
+{
+  return (uint)lib_ghashutil_combine_hash(mapping->strings[filepath].hash,
+                                          mapping->strings[id_name].hash);
+}
+
+/* Find the slot of the given key, or the slot where it should be added if `r_free_slot` is given.
+ */
+static LibWeakRefSlot *lib_weak_ref_slot_find(const LibWeakRefMapping *mapping,
+                                              const uint filepath,
+                                              const uint id_name,
+                                              LibWeakRefSlot **r_free_slot)
+{
+  LibWeakRefSlot *free_slot = NULL;
+  const uint hash = lib_weak_ref_slot_hash(mapping, filepath, id_name);
+  for (uint i = hash & mapping->slots_mask;; i = (i + 1) & mapping->slots_mask) {
+    LibWeakRefSlot *slot = &mapping->slots[i];
+    if (slot->id == NULL) {
+      if (free_slot == NULL) {
+        free_slot = slot;
+      }
+      break;
+    }
+    if (slot->id == LIB_WEAK_REF_SLOT_REMOVED) {
+      if (free_slot == NULL) {
+        free_slot = slot;
+      }
+      continue;
+    }
+    if (slot->filepath == filepath && slot->id_name == id_name) {
+      return slot;
+    }
+  }
+  if (r_free_slot != NULL) {
+    *r_free_slot = free_slot;
   }
-  lib_strncpy(key->filepath, lib_path, sizeof(key->filepath));
-  lib_strncpy(key->id_name, id_name, sizeof(key->id_name));
-  return key;
+  return NULL;
 }
 
-static uint lib_weak_key_hash(const void *ptr)
+static void lib_weak_ref_slots_alloc(LibWeakRefMapping *mapping, const uint slots_num)
 {
-  const LibWeakRefKey *string_pair = ptr;
-  uint hash = lib_ghashutil_strhash_p_murmur(string_pair->filepath);
-  return hash ^ lib_ghashutil_strhash_p_murmur(string_pair->id_name);
+  LibWeakRefSlot *old_slots = mapping->slots;
+  const uint old_slots_num = old_slots ? mapping->slots_mask + 1 : 0;
+
+  mapping->slots = mem_callocn(sizeof(*mapping->slots) * slots_num, __func__);
+  mapping->slots_mask = slots_num - 1;
+  mapping->removed_num = 0;
+
+  for (uint i = 0; i < old_slots_num; i++) {
+    const LibWeakRefSlot *old_slot = &old_slots[i];
+    if (old_slot->id > LIB_WEAK_REF_SLOT_REMOVED) {
+      LibWeakRefSlot *slot;
+      lib_weak_ref_slot_find(mapping, old_slot->filepath, old_slot->id_name, &slot);
+      *slot = *old_slot;
+    }
+  }
+  MEM_SAFE_FREE(old_slots);
 }
 
-static bool lib_weak_key_cmp(const void *a, const void *b)
+static void lib_weak_ref_item_insert(LibWeakRefMapping *mapping,
+                                     const uint filepath,
+                                     const uint id_name,
+                                     Id *id)
 {
-  const LibWeakRefKey *string_pair_a = a;
-  const LibWeakRefKey *string_pair_b = b;
+  if ((mapping->used_num + mapping->removed_num + 1) * 2 > mapping->slots_mask + 1) {
+    const uint slots_num = power_of_2_max_u((mapping->used_num + 1) * 4);
+    lib_weak_ref_slots_alloc(mapping, MAX2((uint)LIB_WEAK_REF_SLOTS_MIN, slots_num));
+  }
+
+  LibWeakRefSlot *slot;
+  const LibWeakRefSlot *existing_slot = lib_weak_ref_slot_find(mapping, filepath, id_name, &slot);
+  lib_assert(existing_slot == NULL);
+  UNUSED_VARS_NDEBUG(existing_slot);
+
+  if (slot->id == LIB_WEAK_REF_SLOT_REMOVED) {
+    mapping->removed_num--;
+  }
+  slot->filepath = filepath;
+  slot->id_name = id_name;
+  slot->id = id;
+  mapping->used_num++;
+}
 
-  return !(STREQ(string_pair_a->filepath, string_pair_b->filepath) &&
-           STREQ(string_pair_a->id_name, string_pair_b->id_name));
+/* Find the slot of an existing item, from its strings. */
+static LibWeakRefSlot *lib_weak_ref_item_find(const LibWeakRefMapping *mapping,
+                                              const char *lib_filepath,
+                                              const char *lib_id_name)
+{
+  const uint filepath = main_lib_weak_ref_string_find(mapping, lib_filepath, FILE_MAX);
+  const uint id_name = main_lib_weak_ref_string_find(mapping, lib_id_name, MAX_ID_NAME);
+  if (filepath == LIB_WEAK_REF_HANDLE_NONE || id_name == LIB_WEAK_REF_HANDLE_NONE) {
+    return NULL;
+  }
+  return lib_weak_ref_slot_find(mapping, filepath, id_name, NULL);
 }
 
-GHash *main_lib_weak_refer_create(Main *main)
+LibWeakRefMapping *main_lib_weak_ref_create(Main *main)
 {
-  GHash *lib_weak_ref_mapping = lib_ghash_new(
-      lib_weak_key_hash, lib_weak_key_cmp, __func__);
+  LibWeakRefMapping *mapping = mem_callocn(sizeof(*mapping), __func__);
+  mapping->strings_arena = lib_memarena_new(LIB_MEMARENA_STD_BUFSIZE, __func__);
+  lib_weak_ref_string_slots_alloc(mapping, LIB_WEAK_REF_SLOTS_MIN);
+  lib_weak_ref_slots_alloc(mapping, LIB_WEAK_REF_SLOTS_MIN);
 
   List *list;
   FOREACH_MAIN_LIST_BEGIN (main, lb) {
@@ -392,33 +1729,52 @@ GHash *main_lib_weak_refer_create(Main *main)
       if (id_iter->lib_weak_ref == NULL) {
         continue;
       }
-      LibWeakRefKey *key = lib_weak_key_create(NULL,
-                                               id_iter->lib_weak_ref->lib_filepath,
-                                               id_iter->lib_weak_ref->lib_id_name);
-      lib_ghash_insert(lib_weak_ref_mapping, key, id_iter);
+      const uint filepath = main_lib_weak_ref_string_ensure(
+          mapping, id_iter->lib_weak_ref->lib_filepath, FILE_MAX);
+      const uint id_name = main_lib_weak_ref_string_ensure(
+          mapping, id_iter->lib_weak_ref->lib_id_name, MAX_ID_NAME);
+      lib_weak_ref_item_insert(mapping, filepath, id_name, id_iter);
     }
     FOREACH_MAIN_LIST_ID_END;
   }
   FOREACH_MAIN_LIST_END;
 
-  return lib_weak_ref_mapping;
+  return mapping;
 }
 
-void main_lib_weak_ref_destroy(GHash *lib_weak_ref_mapping)
+void main_lib_weak_ref_destroy(LibWeakRefMapping *lib_weak_ref_mapping)
 {
-  lib_ghash_free(lib_weak_ref_mapping, mem_freen, NULL);
+  lib_memarena_free(lib_weak_ref_mapping->strings_arena);
+  MEM_SAFE_FREE(lib_weak_ref_mapping->strings);
+  MEM_SAFE_FREE(lib_weak_ref_mapping->string_slots);
+  MEM_SAFE_FREE(lib_weak_ref_mapping->slots);
+  mem_freen(lib_weak_ref_mapping);
 }
 
-Id *main_lib_weak_ref_search_item(GHash *lib_weak_ref_mapping,
+Id *main_lib_weak_ref_search_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                   const char *lib_filepath,
                                   const char *lib_id_name)
 {
-  LibWeakRefKey key;
-  lib_weak_key_create(&key, lib_filepath, lib_id_name);
-  return (Id *)lib_ghash_lookup(lib_weak_ref_mapping, &key);
+  const LibWeakRefSlot *slot = lib_weak_ref_item_find(
+      lib_weak_ref_mapping, lib_filepath, lib_id_name);
+  return slot != NULL ? slot->id : NULL;
 }
 
-void main_lib_weak_ref_add_item(GHash *lib_weak_ref_mapping,
+Id *main_lib_weak_ref_search_item_handles(const LibWeakRefMapping *lib_weak_ref_mapping,
+                                          const uint lib_filepath,
+                                          const uint lib_id_name)
+{
+  if (lib_filepath == LIB_WEAK_REF_HANDLE_NONE || lib_id_name == LIB_WEAK_REF_HANDLE_NONE) {
+    return NULL;
+  }
+  lib_assert(lib_filepath < lib_weak_ref_mapping->strings_num);
+  lib_assert(lib_id_name < lib_weak_ref_mapping->strings_num);
+  const LibWeakRefSlot *slot = lib_weak_ref_slot_find(
+      lib_weak_ref_mapping, lib_filepath, lib_id_name, NULL);
+  return slot != NULL ? slot->id : NULL;
+}
+
+void main_lib_weak_ref_add_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                 const char *lib_filepath,
                                 const char *lib_id_name,
                                 Id *new_id)
@@ -430,12 +1786,11 @@ void main_lib_weak_ref_add_item(GHash *lib_weak_ref_mapping,
   new_id->lib_weak_ref = mem_mallocn(sizeof(*(new_id->lib_weak_ref)),
                                                __func__);
 
-  LibWeakRefKey *key = lib_weak_key_create(NULL, lib_filepath, lib_id_name);
-  void **id_p;
-  const bool already_exist_in_mapping = lib_ghash_ensure_p(
-      lib_weak_ref_mapping, key, &id_p);
-  lib_assert(!already_exist_in_mapping);
-  UNUSED_VARS_NDEBUG(already_exist_in_mapping);
+  lib_weak_ref_item_insert(
+      lib_weak_ref_mapping,
+      main_lib_weak_ref_string_ensure(lib_weak_ref_mapping, lib_filepath, FILE_MAX),
+      main_lib_weak_ref_string_ensure(lib_weak_ref_mapping, lib_id_name, MAX_ID_NAME),
+      new_id);
 
   lib_strncpy(new_id->lib_weak_ref->lib_filepath,
               lib_filepath,
@@ -443,10 +1798,9 @@ void main_lib_weak_ref_add_item(GHash *lib_weak_ref_mapping,
   lib_strncpy(new_id->lib_weak_ref->lib_id_name,
               lib_id_name,
               sizeof(new_id->lib_weak_ref->lib_id_name));
-  *id_p = new_id;
 }
 
-void main_lib_weak_ref_update_item(GHash *lib_weak_ref_mapping,
+void main_lib_weak_ref_update_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                    const char *lib_filepath,
                                    const char *lib_id_name,
                                    Id *old_id,
@@ -459,17 +1813,15 @@ void main_lib_weak_ref_update_item(GHash *lib_weak_ref_mapping,
   lib_assert(STREQ(old_id->lib_weak_ref->lib_filepath, lib_filepath));
   lib_assert(STREQ(old_id->lib_weak_ref->lib_id_name, lib_id_name));
 
-  LibWeakRefKey key;
-  lib_weak_key_create(&key, lib_filepath, lib_id_name);
-  void **id_p = lib_ghash_lookup_p(lib_weak_ref_mapping, &key);
-  lib_assert(id_p != NULL && *id_p == old_id);
+  LibWeakRefSlot *slot = lib_weak_ref_item_find(lib_weak_ref_mapping, lib_filepath, lib_id_name);
+  lib_assert(slot != NULL && slot->id == old_id);
 
   new_id->lib_weak_ref = old_id->lib_weak_ref;
   old_id->lib_weak_ref = NULL;
-  *id_p = new_id;
+  slot->id = new_id;
 }
 
-void main_lib_weak_ref_remove_item(GHash *lib_weak_ref_mapping,
+void main_lib_weak_ref_remove_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                    const char *lib_filepath,
                                    const char *lib_id_name,
                                    Id *old_id)
@@ -477,31 +1829,142 @@ void main_lib_weak_ref_remove_item(GHash *lib_weak_ref_mapping,
   lib_assert(GS(lib_id_name) == GS(old_id->name));
   lib_assert(old_id->lib_weak_ref != NULL);
 
-  LibWeakRefKey key;
-  lib_weak_key_create(&key, lib_filepath, lib_id_name);
-
-  lib_assert(lib_ghash_lookup(lib_weak_ref_mapping, &key) == old_id);
-  lib_ghash_remove(lib_weak_ref_mapping, &key, mem_freen, NULL);
+  LibWeakRefSlot *slot = lib_weak_ref_item_find(lib_weak_ref_mapping, lib_filepath, lib_id_name);
+  lib_assert(slot != NULL && slot->id == old_id);
+  if (slot != NULL) {
+    /* Interned strings are kept, they may be used again. */
+    slot->id = LIB_WEAK_REF_SLOT_REMOVED;
+    lib_weak_ref_mapping->used_num--;
+    lib_weak_ref_mapping->removed_num++;
+  }
 
   MEM_SAFE_FREE(old_id->library_weak_ref);
 }
 
+/* Last generated thumbnail, see main_thumbnail_from_imbuf. */
+static struct {
+  ThreadMutex mutex;
+  /* Size and MD5 digest of the source image pixels. */
+  int width, height;
+  uchar digest[16];
+  Thumbnail *data;
+} main_thumbnail_cache = {LIB_MUTEX_INITIALIZER, 0, 0, {0}, NULL};
+
+static void main_thumbnail_cache_free(void)
+{
+  lib_mutex_lock(&main_thumbnail_cache.mutex);
+  MEM_SAFE_FREE(main_thumbnail_cache.data);
+  lib_mutex_unlock(&main_thumbnail_cache.mutex);
+}
+
+/* Downscale `rect` (RGBA bytes) by an integer `factor` into `data`, averaging each block of
+ * `factor * factor` pixels (partial blocks on the right and top borders average what they
+ * cover). Plain loops over integer sums, without intrinsics, which compilers vectorize. */
+static void main_thumbnail_downscale_box(const uchar *rect,
+                                         const int width,
+                                         const int height,
+                                         const int factor,
+                                         Thumbnail *data)
+{
+  uchar *dst = (uchar *)data->rect;
+  uint *sums = mem_mallocn(sizeof(*sums) * 4 * (size_t)data->width, __func__);
+
+  for (int y = 0; y < data->height; y++) {
+    const int y_start = y * factor;
+    const int y_end = MIN2(y_start + factor, height);
+    memset(sums, 0, sizeof(*sums) * 4 * (size_t)data->width);
+
+    /* Accumulate the source rows of that block row. */
+    for (int src_y = y_start; src_y < y_end; src_y++) {
+      const uchar *src_row = &rect[(size_t)src_y * (size_t)width * 4];
+      for (int x = 0; x < data->width; x++) {
+        const int x_start = x * factor;
+        const int x_end = MIN2(x_start + factor, width);
+        uint *sum = &sums[x * 4];
+        for (int src_x = x_start; src_x < x_end; src_x++) {
+          const uchar *src = &src_row[src_x * 4];
+          sum[0] += src[0];
+          sum[1] += src[1];
+          sum[2] += src[2];
+          sum[3] += src[3];
+        }
+      }
+    }
+
+    uchar *dst_row = &dst[(size_t)y * (size_t)data->width * 4];
+    for (int x = 0; x < data->width; x++) {
+      const int x_start = x * factor;
+      const uint count = (uint)((MIN2(x_start + factor, width) - x_start) * (y_end - y_start));
+      for (int c = 0; c < 4; c++) {
+        dst_row[x * 4 + c] = (uchar)((sums[x * 4 + c] + count / 2) / count);
+      }
+    }
+  }
+
+  mem_freen(sums);
+}
+
+static Thumbnail *main_thumbnail_generate(ImBuf *img)
+{
+  imbuf_rect_from_float(img); /* Just in case... */
+
+  const uchar *rect = (const uchar *)img->rect;
+  const size_t rect_size = (size_t)img->x * (size_t)img->y * 4;
+
+  /* A 128 bits digest, so that a different image never gets the cached thumbnail in practice.
+   * Always computed, so that the cache can be hit by the next generation already. */
+  uchar digest[16];
+  lib_hash_md5_buffer((const char *)rect, rect_size, digest);
+
+  lib_mutex_lock(&main_thumbnail_cache.mutex);
+  if (main_thumbnail_cache.data != NULL && main_thumbnail_cache.width == img->x &&
+      main_thumbnail_cache.height == img->y &&
+      memcmp(main_thumbnail_cache.digest, digest, sizeof(digest)) == 0)
+  {
+    Thumbnail *data = mem_dupallocn(main_thumbnail_cache.data);
+    lib_mutex_unlock(&main_thumbnail_cache.mutex);
+    return data;
+  }
+  lib_mutex_unlock(&main_thumbnail_cache.mutex);
+
+  /* Smallest integer factor fitting the image in THUMB_SIZE. */
+  const int factor = (int)MAX2(divide_ceil_u((uint)img->x, THUMB_SIZE),
+                               divide_ceil_u((uint)img->y, THUMB_SIZE));
+  const int width = (int)divide_ceil_u((uint)img->x, (uint)factor);
+  const int height = (int)divide_ceil_u((uint)img->y, (uint)factor);
+
+  Thumbnail *data = mem_mallocn(THUMB_MEMSIZE(width, height), __func__);
+  data->width = width;
+  data->height = height;
+  if (factor == 1) {
+    memcpy(data->rect, rect, rect_size);
+  }
+  else {
+    main_thumbnail_downscale_box(rect, img->x, img->y, factor, data);
+  }
+
+  lib_mutex_lock(&main_thumbnail_cache.mutex);
+  MEM_SAFE_FREE(main_thumbnail_cache.data);
+  main_thumbnail_cache.data = mem_dupallocn(data);
+  memcpy(main_thumbnail_cache.digest, digest, sizeof(digest));
+  main_thumbnail_cache.width = img->x;
+  main_thumbnail_cache.height = img->y;
+  lib_mutex_unlock(&main_thumbnail_cache.mutex);
+
+  return data;
+}
+
 Thumbnail *main_thumbnail_from_imbuf(Main *main, ImBuf *img)
 {
   Thumbnail *data = NULL;
 
   if (main) {
+    main_thumbnail_wait(main);
     MEM_SAFE_FREE(main->thumb);
   }
 
   if (img) {
-    const size_t sz = THUMB_MEMSIZE(img->x, img->y);
-    data = mem_mallocn(sz, __func__);
-
-    imbuf_rect_from_float(img); /* Just in case... */
-    data->width = img->x;
-    data->height = img->y;
-    memcpy(data->rect, img->rect, sz - sizeof(*data));
+    data = main_thumbnail_generate(img);
   }
 
   if (main) {
@@ -510,11 +1973,53 @@ Thumbnail *main_thumbnail_from_imbuf(Main *main, ImBuf *img)
   return data;
 }
 
+struct MainThumbnailJob {
+  TaskPool *task_pool;
+  ImBuf *img;
+  /* Set by the worker. */
+  Thumbnail *result;
+};
+
+static void main_thumbnail_job_run(TaskPool *__restrict pool, void *UNUSED(taskdata))
+{
+  struct MainThumbnailJob *job = lib_task_pool_user_data(pool);
+  job->result = main_thumbnail_generate(job->img);
+}
+
+void main_thumbnail_from_imbuf_async(Main *main, ImBuf *img)
+{
+  main_thumbnail_wait(main);
+
+  struct MainThumbnailJob *job = mem_callocn(sizeof(*job), __func__);
+  job->img = img;
+  job->task_pool = lib_task_pool_create_background(job, TASK_PRIORITY_LOW);
+  main->thumb_job = job;
+  lib_task_pool_push(job->task_pool, main_thumbnail_job_run, NULL, false, NULL);
+}
+
+void main_thumbnail_wait(Main *main)
+{
+  struct MainThumbnailJob *job = main->thumb_job;
+  if (job == NULL) {
+    return;
+  }
+
+  lib_task_pool_work_and_wait(job->task_pool);
+  lib_task_pool_free(job->task_pool);
+  imbuf_freeImBuf(job->img);
+
+  MEM_SAFE_FREE(main->tray_thumb);
+  main->tray_thumb = job->result;
+  main->thumb_job = NULL;
+  mem_freen(job);
+}
+
 ImBuf *main_thumbnail_to_imbuf(Main *main, Thumbnail *data)
 {
   ImBuf *img = NULL;
 
   if (!data && main) {
+    main_thumbnail_wait(main);
     data = main->thumb;
   }
 
@@ -528,6 +2033,7 @@ ImBuf *main_thumbnail_to_imbuf(Main *main, Thumbnail *data)
 
 void main_thumbnail_create(struct Main *main)
 {
+  main_thumbnail_wait(main);
   MEM_SAFE_FREE(main->tray_thumb);
 
   main->thumb = mem_callocn(THUMB_MEMSIZE(THUMB_SIZE, THUMB_SIZE), __func__);
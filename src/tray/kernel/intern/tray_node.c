@@ -2,10 +2,14 @@
 
 #include "mem_guardedalloc.h"
 
+#include "atomic_ops.h"
+
+#include <algorithm>
 #include <climits>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
 
 /* Allow using deprecated functionality for .tray file I/O. */
 #define TYPES_DEPRECATED_ALLOW
@@ -28,7 +32,9 @@
 #include "lib_stack.hh"
 #include "lib_string.h"
 #include "lib_string_utils.h"
+#include "lib_task.h"
 #include "lib_threads.h"
+#include "lib_timer.h"
 #include "lib_utildefines.h"
 #include "lib_vector_set.hh"
 #include "lang.h"
@@ -46,6 +52,7 @@
 #include "tray_lib_query.h"
 #include "tray_main.h"
 #include "tray_node.h"
+#include "tray_node_runtime.hh"
 #include "tray_node_tree_update.h"
 
 #include "api_access.h"
@@ -72,6 +79,7 @@
 #define NODE_DEFAULT_MAX_WIDTH 700
 
 using tray::Array;
+using tray::IndexRange;
 using tray::Map;
 using tray::MutableSpan;
 using tray::Set;
@@ -97,8 +105,14 @@ static CLG_LogRef LOG = {"tray.node"};
 
 static void ntree_set_typeinfo(NodeTree *ntree, NodeTreeType *typeinfo);
 static void node_socket_copy(NodeSocket *sock_dst, const NodeSocket *sock_src, const int flag);
+static Node *node_copy_shared_with_mapping(NodeTree *dst_tree,
+                                           const Node &node_src,
+                                           Map<const NodeSocket *, NodeSocket *> &socket_map);
 static void free_localized_node_groups(NodeTree *ntree);
+static void node_local_shared_data_detach(Node *node);
+static void node_local_shared_data_detach_all(NodeTree *ntree);
 static void node_free_node(NodeTree *ntree, Node *node);
+static NodeInstanceHash *node_previews_copy(NodeInstanceHash *previews_src);
 static void node_socket_interface_free(NodeTree *UNUSED(ntree),
                                        NodeSocket *sock,
                                        const bool do_id_user);
@@ -122,6 +136,7 @@ static void ntree_copy_data(Main *UNUSED(main), Id *id_dst, const Id *id_src, co
 
   /* in case a running nodetree is copied */
   ntree_dst->execdata = nullptr;
+  ntree_dst->runtime = nullptr;
   
   lib_list_clear(&ntree_dst->nodes);
   lib_list_clear(&ntree_dst->links);
@@ -131,6 +146,10 @@ static void ntree_copy_data(Main *UNUSED(main), Id *id_dst, const Id *id_src, co
 
   lib_list_clear(&ntree_dst->nodes);
   LIST_FOREACH (const Node *, src_node, &ntree_src->nodes) {
+    if (flag & LIB_ID_COPY_NODETREE_SHARE_DATA) {
+      node_map.add(src_node, node_copy_shared_with_mapping(ntree_dst, *src_node, socket_map));
+      continue;
+    }
     /* Don't find a unique name for every node, since they should have valid names already. */
     Node *new_node = tray::node_copy_with_mapping(
         ntree_dst, *src_node, flag_subdata, false, socket_map);
@@ -166,15 +185,7 @@ static void ntree_copy_data(Main *UNUSED(main), Id *id_dst, const Id *id_src, co
 
   /* copy preview hash */
   if (ntree_src->previews && (flag & LIB_ID_COPY_NO_PREVIEW) == 0) {
-    NodeInstanceHashIter iter;
-
-    ntree_dst->previews = node_instance_hash_new("node previews");
-
-    NODE_INSTANCE_HASH_ITER (iter, ntree_src->previews) {
-      NodeInstanceKey key = node_instance_hash_iter_get_key(&iter);
-      NodePreview *preview = (NodePreview *)node_instance_hash_iter_get_value(&iter);
-      node_instance_hash_insert(ntree_dst->previews, key, node_preview_copy(preview));
-    }
+    ntree_dst->previews = node_previews_copy(ntree_src->previews);
   }
   else {
     ntree_dst->previews = nullptr;
@@ -224,10 +235,15 @@ static void ntree_free_data(Id *id)
 
   /* XXX not nice, but needed to free localized node groups properly */
   free_localized_node_groups(ntree);
+  /* Before the runtime is freed, it knows which nodes share data with the original tree. */
+  node_local_shared_data_detach_all(ntree);
 
   /* Unregister associated RNA types. */
   ntreeInterfaceTypeFree(ntree);
 
+  /* Links and nodes are freed directly below, drop runtime caches instead of updating them. */
+  dune::node_tree_runtime_free(*ntree);
+
   lib_freelistn(&ntree->links);
 
   LIST_FOREACH_MUTABLE (Node *, node, &ntree->nodes) {
@@ -315,8 +331,14 @@ static CLG_LogRef LOG = {"tray.node"};
 
 static void ntree_set_typeinfo(NodeTree *ntree, NodeTreeType *typeinfo);
 static void node_socket_copy(NodeSocket *sock_dst, const NodeSocket *sock_src, const int flag);
+static Node *node_copy_shared_with_mapping(NodeTree *dst_tree,
+                                           const Node &node_src,
+                                           Map<const NodeSocket *, NodeSocket *> &socket_map);
 static void free_localized_node_groups(NodeTree *ntree);
+static void node_local_shared_data_detach(Node *node);
+static void node_local_shared_data_detach_all(NodeTree *ntree);
 static void node_free_node(NodeTree *ntree, Node *node);
+static NodeInstanceHash *node_previews_copy(NodeInstanceHash *previews_src);
 static void node_socket_interface_free(NodeTree *UNUSED(ntree),
                                        NodeSocket *sock,
                                        const bool do_id_user);
@@ -340,6 +362,7 @@ static void ntree_copy_data(Main *UNUSED(main), Id *id_dst, const Id *id_src, co
 
   /* in case a running nodetree is copied */
   ntree_dst->execdata = nullptr;
+  ntree_dst->runtime = nullptr;
 
   lib_list_clear(&ntree_dst->nodes);
   lib_list_clear(&ntree_dst->links);
@@ -349,6 +372,10 @@ static void ntree_copy_data(Main *UNUSED(main), Id *id_dst, const Id *id_src, co
 
   lib_list_clear(&ntree_dst->nodes);
   LIST_FOREACH (const Node *, src_node, &ntree_src->nodes) {
+    if (flag & LIB_ID_COPY_NODETREE_SHARE_DATA) {
+      node_map.add(src_node, node_copy_shared_with_mapping(ntree_dst, *src_node, socket_map));
+      continue;
+    }
     /* Don't find a unique name for every node, since they should have valid names already. */
     Node *new_node = tray::node_copy_with_mapping(
         ntree_dst, *src_node, flag_subdata, false, socket_map);
@@ -384,15 +411,7 @@ static void ntree_copy_data(Main *UNUSED(main), Id *id_dst, const Id *id_src, co
 
   /* copy preview hash */
   if (ntree_src->previews && (flag & LIB_ID_COPY_NO_PREVIEW) == 0) {
-    NodeInstanceHashIter iter;
-
-    ntree_dst->previews = node_instance_hash_new("node previews");
-
-    NODE_INSTANCE_HASH_ITER (iter, ntree_src->previews) {
-      NodeInstanceKey key = node_instance_hash_iter_get_key(&iter);
-      NodePreview *preview = (NodePreview *)node_instance_hash_iter_get_value(&iter);
-      node_instance_hash_insert(ntree_dst->previews, key, node_preview_copy(preview));
-    }
+    ntree_dst->previews = node_previews_copy(ntree_src->previews);
   }
   else {
     ntree_dst->previews = nullptr;
@@ -442,10 +461,15 @@ static void ntree_free_data(Id *id)
 
   /* not nice, but needed to free localized node groups properly */
   free_localized_node_groups(ntree);
+  /* Before the runtime is freed, it knows which nodes share data with the original tree. */
+  node_local_shared_data_detach_all(ntree);
 
   /* Unregister associated api types. */
   ntreeInterfaceTypeFree(ntree);
 
+  /* Links and nodes are freed directly below, drop runtime caches instead of updating them. */
+  dune::node_tree_runtime_free(*ntree);
+
   lib_freelistn(&ntree->links);
 
   LIST_FOREACH_MUTABLE (Node *, node, &ntree->nodes) {
@@ -874,6 +898,7 @@ void ntreeReadData(DataReader *reader, NodeTree *ntree)
   ntree->execdata = nullptr;
 
   ntree->field_inferencing_interface = nullptr;
+  ntree->runtime = nullptr;
   ntree_update_tag_missing_runtime_data(ntree);
 
   loader_read_data_address(reader, &ntree->adt);
@@ -1686,6 +1711,426 @@ static bool unique_id_check(void *arg, const char *id)
   return false;
 }
 
+namespace dune {
+
+NodeTreeRuntime &node_tree_runtime_ensure(NodeTree &ntree)
+{
+  /* May be called from multiple threads reading the tree (see the cache ensure functions below),
+   * only one of them installs its runtime. */
+  NodeTreeRuntime *runtime = static_cast<NodeTreeRuntime *>(
+      atomic_load_ptr((void *const *)&ntree.runtime));
+  if (runtime == nullptr) {
+    NodeTreeRuntime *new_runtime = new NodeTreeRuntime();
+    runtime = static_cast<NodeTreeRuntime *>(
+        atomic_cas_ptr((void **)&ntree.runtime, nullptr, new_runtime));
+    if (runtime == nullptr) {
+      runtime = new_runtime;
+    }
+    else {
+      delete new_runtime;
+    }
+  }
+  return *runtime;
+}
+
+void node_tree_runtime_free(NodeTree &ntree)
+{
+  delete ntree.runtime;
+  ntree.runtime = nullptr;
+}
+
+static void node_links_index_add(NodeTreeRuntime &runtime, NodeLink *link)
+{
+  runtime.links_by_socket.lookup_or_add_default(link->fromsock).append(link);
+  runtime.links_by_socket.lookup_or_add_default(link->tosock).append(link);
+  runtime.output_links_by_node.lookup_or_add_default(link->fromnode).append(link);
+  runtime.input_links_by_node.lookup_or_add_default(link->tonode).append(link);
+}
+
+/* Remove `link` from the links of `key`, return false if it is not there. */
+template<typename Key>
+static bool node_links_index_remove_from(Map<const Key *, Vector<NodeLink *>> &links_map,
+                                         const Key *key,
+                                         NodeLink *link)
+{
+  Vector<NodeLink *> *links = links_map.lookup_ptr(key);
+  if (links == nullptr) {
+    return false;
+  }
+  const int64_t index = links->first_index_of_try(link);
+  if (index == -1) {
+    return false;
+  }
+  links->remove_and_reorder(index);
+  return true;
+}
+
+static void node_links_index_remove(NodeTreeRuntime &runtime, NodeLink *link)
+{
+  if (!node_links_index_remove_from(runtime.links_by_socket, link->fromsock, link) ||
+      !node_links_index_remove_from(runtime.links_by_socket, link->tosock, link) ||
+      !node_links_index_remove_from(runtime.output_links_by_node, link->fromnode, link) ||
+      !node_links_index_remove_from(runtime.input_links_by_node, link->tonode, link))
+  {
+    /* The link was not indexed, e.g. the links were edited directly without tagging the index
+     * dirty, rebuild it on next use. */
+    runtime.links_index_is_valid = false;
+  }
+}
+
+/* Runtime with a valid links index, or null if there is no index to maintain. */
+static NodeTreeRuntime *node_links_index_get_if_valid(NodeTree *ntree)
+{
+  if (ntree == nullptr || ntree->runtime == nullptr || !ntree->runtime->links_index_is_valid) {
+    return nullptr;
+  }
+  return ntree->runtime;
+}
+
+static NodeTreeRuntime &node_links_index_ensure(const NodeTree &ntree)
+{
+  /* The index is a cache, building it does not change the tree. */
+  NodeTreeRuntime &runtime = node_tree_runtime_ensure(const_cast<NodeTree &>(ntree));
+  std::lock_guard lock{runtime.cache_mutex};
+  if (!runtime.links_index_is_valid) {
+    runtime.links_by_socket.clear();
+    runtime.input_links_by_node.clear();
+    runtime.output_links_by_node.clear();
+    LIST_FOREACH (NodeLink *, link, &ntree.links) {
+      node_links_index_add(runtime, link);
+    }
+    runtime.links_index_is_valid = true;
+  }
+  return runtime;
+}
+
+void node_tree_links_index_tag_dirty(NodeTree &ntree)
+{
+  if (ntree.runtime) {
+    ntree.runtime->links_index_is_valid = false;
+  }
+}
+
+Span<NodeLink *> node_socket_links(const NodeTree &ntree, const NodeSocket &socket)
+{
+  const NodeTreeRuntime &runtime = node_links_index_ensure(ntree);
+  const Vector<NodeLink *> *links = runtime.links_by_socket.lookup_ptr(&socket);
+  return links ? links->as_span() : Span<NodeLink *>();
+}
+
+Span<NodeLink *> node_input_links(const NodeTree &ntree, const Node &node)
+{
+  const NodeTreeRuntime &runtime = node_links_index_ensure(ntree);
+  const Vector<NodeLink *> *links = runtime.input_links_by_node.lookup_ptr(&node);
+  return links ? links->as_span() : Span<NodeLink *>();
+}
+
+Span<NodeLink *> node_output_links(const NodeTree &ntree, const Node &node)
+{
+  const NodeTreeRuntime &runtime = node_links_index_ensure(ntree);
+  const Vector<NodeLink *> *links = runtime.output_links_by_node.lookup_ptr(&node);
+  return links ? links->as_span() : Span<NodeLink *>();
+}
+
+/* Runtime with a valid socket owners map, or null if there is no map to maintain. */
+static NodeTreeRuntime *node_socket_owners_get_if_valid(NodeTree *ntree)
+{
+  if (ntree == nullptr || ntree->runtime == nullptr || !ntree->runtime->socket_owners_is_valid) {
+    return nullptr;
+  }
+  return ntree->runtime;
+}
+
+static void node_socket_owners_add_node(NodeTreeRuntime &runtime, Node *node)
+{
+  int index = 0;
+  LIST_FOREACH (NodeSocket *, sock, &node->inputs) {
+    runtime.socket_owners.add_overwrite(sock, {node, index++});
+  }
+  index = 0;
+  LIST_FOREACH (NodeSocket *, sock, &node->outputs) {
+    runtime.socket_owners.add_overwrite(sock, {node, index++});
+  }
+}
+
+static void node_socket_owners_remove_node(NodeTreeRuntime &runtime, const Node *node)
+{
+  LIST_FOREACH (NodeSocket *, sock, &node->inputs) {
+    runtime.socket_owners.remove(sock);
+  }
+  LIST_FOREACH (NodeSocket *, sock, &node->outputs) {
+    runtime.socket_owners.remove(sock);
+  }
+}
+
+static NodeTreeRuntime &node_socket_owners_ensure(const NodeTree &ntree)
+{
+  /* The map is a cache, building it does not change the tree. */
+  NodeTreeRuntime &runtime = node_tree_runtime_ensure(const_cast<NodeTree &>(ntree));
+  std::lock_guard lock{runtime.cache_mutex};
+  if (!runtime.socket_owners_is_valid) {
+    runtime.socket_owners.clear();
+    LIST_FOREACH (Node *, node, &ntree.nodes) {
+      node_socket_owners_add_node(runtime, node);
+    }
+    runtime.socket_owners_is_valid = true;
+  }
+  return runtime;
+}
+
+void node_tree_socket_owners_tag_dirty(NodeTree &ntree)
+{
+  if (ntree.runtime) {
+    ntree.runtime->socket_owners_is_valid = false;
+  }
+}
+
+bool node_tree_socket_owners_validate(const NodeTree &ntree)
+{
+  if (ntree.runtime == nullptr || !ntree.runtime->socket_owners_is_valid) {
+    return true;
+  }
+  const Map<const NodeSocket *, NodeSocketOwner> &socket_owners = ntree.runtime->socket_owners;
+  bool is_valid = true;
+  int64_t sockets_num = 0;
+
+  auto validate_sockets = [&](const Node *node, const List *sockets) {
+    int index = 0;
+    LIST_FOREACH (const NodeSocket *, sock, sockets) {
+      const NodeSocketOwner *owner = socket_owners.lookup_ptr(sock);
+      if (owner == nullptr) {
+        CLOG_ERROR(&LOG, "socket %s of node %s has no owner", sock->id, node->name);
+        is_valid = false;
+      }
+      else if (owner->node != node || owner->index != index) {
+        CLOG_ERROR(&LOG,
+                   "socket %s of node %s has wrong owner %s at index %d instead of %d",
+                   sock->id,
+                   node->name,
+                   owner->node->name,
+                   owner->index,
+                   index);
+        is_valid = false;
+      }
+      index++;
+      sockets_num++;
+    }
+  };
+
+  LIST_FOREACH (const Node *, node, &ntree.nodes) {
+    validate_sockets(node, &node->inputs);
+    validate_sockets(node, &node->outputs);
+  }
+
+  if (sockets_num != socket_owners.size()) {
+    CLOG_ERROR(&LOG,
+               "%d socket owners stored for %d sockets",
+               int(socket_owners.size()),
+               int(sockets_num));
+    is_valid = false;
+  }
+  return is_valid;
+}
+
+void node_tree_topology_tag_dirty(NodeTree &ntree)
+{
+  if (ntree.runtime) {
+    ntree.runtime->topology.reset();
+    ntree.runtime->levels_are_valid = false;
+  }
+}
+
+void node_tree_levels_tag_dirty(NodeTree &ntree)
+{
+  if (ntree.runtime) {
+    ntree.runtime->levels_are_valid = false;
+  }
+}
+
+static bool node_levels_are_valid(const NodeTree *ntree)
+{
+  return ntree && ntree->runtime && ntree->runtime->levels_are_valid;
+}
+
+/* Order independent hash of the parent of every node, nodeAttachNode and nodeDetachNode have no
+ * tree to invalidate the levels of, so parent changes are detected by comparing it. */
+static uint64_t node_levels_parents_hash(const NodeTree &ntree)
+{
+  uint64_t hash = 0;
+  LIST_FOREACH (const Node *, node, &ntree.nodes) {
+    if (node->parent) {
+      hash += (uint64_t(uintptr_t(node)) * 0x9E3779B97F4A7C15ull) ^ uintptr_t(node->parent);
+    }
+  }
+  return hash;
+}
+
+/* Store the result of a full level update. */
+static void node_levels_set_updated(NodeTree &ntree, const bool has_cycle)
+{
+  NodeTreeRuntime &runtime = node_tree_runtime_ensure(ntree);
+  runtime.levels_are_valid = !has_cycle;
+  runtime.levels_parents_hash = node_levels_parents_hash(ntree);
+}
+
+/* Level of a node from the levels of its dependencies, see node_deplist_sort. */
+static int node_level_from_dependencies(const NodeTree &ntree, const Node &node)
+{
+  int level = 0xFFF;
+  for (const NodeLink *link : node_input_links(ntree, node)) {
+    level = std::min(level, link->fromnode->level - 1);
+  }
+  if (node.parent) {
+    level = std::min(level, node.parent->level - 1);
+  }
+  return level;
+}
+
+/* Lower the levels downstream of a new link, so that they stay below the levels of all their
+ * dependencies.
+ * return false when the levels could not be updated incrementally, because the link creates a
+ * cycle or a frame (whose children are not indexed) is downstream. */
+static bool node_levels_update_link_added(NodeTree &ntree, const NodeLink &link)
+{
+  Node *from_node = link.fromnode;
+  Node *to_node = link.tonode;
+  if (to_node->level < from_node->level) {
+    return true;
+  }
+
+  to_node->level = from_node->level - 1;
+  Stack<Node *> stack;
+  stack.push(to_node);
+  while (!stack.is_empty()) {
+    Node *node = stack.pop();
+    if (node->type == NODE_FRAME) {
+      return false;
+    }
+    for (NodeLink *output_link : node_output_links(ntree, *node)) {
+      Node *next_node = output_link->tonode;
+      if (next_node == from_node) {
+        return false;
+      }
+      if (next_node->level >= node->level) {
+        next_node->level = node->level - 1;
+        stack.push(next_node);
+      }
+    }
+  }
+  return true;
+}
+
+/* Raise the levels downstream of a removed link when possible, recomputing each node of the
+ * downstream cone from its dependencies, upstream nodes first.
+ * return false when the levels could not be updated incrementally. */
+static bool node_levels_update_link_removed(NodeTree &ntree, Node &to_node)
+{
+  if (node_level_from_dependencies(ntree, to_node) == to_node.level) {
+    return true;
+  }
+
+  Vector<Node *> cone;
+  Set<Node *> visited;
+  Stack<Node *> stack;
+  visited.add_new(&to_node);
+  stack.push(&to_node);
+  while (!stack.is_empty()) {
+    Node *node = stack.pop();
+    if (node->type == NODE_FRAME) {
+      return false;
+    }
+    cone.append(node);
+    for (NodeLink *output_link : node_output_links(ntree, *node)) {
+      if (visited.add(output_link->tonode)) {
+        stack.push(output_link->tonode);
+      }
+    }
+  }
+
+  /* Levels were valid before removing the link, so they still are a topological order. */
+  std::sort(cone.begin(), cone.end(), [](const Node *a, const Node *b) {
+    return a->level > b->level;
+  });
+  for (Node *node : cone) {
+    node->level = node_level_from_dependencies(ntree, *node);
+  }
+  return true;
+}
+
+/* Free the packed topology after a change, `ntree` may be null for nodes outside of trees. */
+static void node_topology_changed(NodeTree *ntree)
+{
+  if (ntree) {
+    node_tree_topology_tag_dirty(*ntree);
+  }
+}
+
+/* Invalidate the nodes by name map after nodes were added, removed or renamed. */
+static void node_names_changed(NodeTree *ntree)
+{
+  if (ntree && ntree->runtime) {
+    ntree->runtime->nodes_by_name_is_valid = false;
+  }
+}
+
+static const NodeTreeRuntime &node_names_ensure(const NodeTree &ntree)
+{
+  /* The map is a cache, building it does not change the tree. */
+  NodeTreeRuntime &runtime = node_tree_runtime_ensure(const_cast<NodeTree &>(ntree));
+  std::lock_guard lock{runtime.cache_mutex};
+  if (!runtime.nodes_by_name_is_valid) {
+    runtime.nodes_by_name.clear();
+    LIST_FOREACH (Node *, node, &ntree.nodes) {
+      /* Not add_new, names set directly may not be unique. */
+      runtime.nodes_by_name.add(node->name, node);
+    }
+    runtime.nodes_by_name_is_valid = true;
+  }
+  return runtime;
+}
+
+const NodeTreeTopology &node_tree_topology_ensure(const NodeTree &ntree)
+{
+  /* The topology is a cache, building it does not change the tree. */
+  NodeTreeRuntime &runtime = node_tree_runtime_ensure(const_cast<NodeTree &>(ntree));
+  std::lock_guard lock{runtime.cache_mutex};
+  if (runtime.topology) {
+    return *runtime.topology;
+  }
+
+  std::unique_ptr<NodeTreeTopology> topology = std::make_unique<NodeTreeTopology>();
+  Map<const NodeSocket *, int> socket_indices;
+
+  topology->input_offsets.append(0);
+  topology->output_offsets.append(0);
+  LIST_FOREACH (Node *, node, &ntree.nodes) {
+    topology->node_indices.add_new(node, topology->nodes.size());
+    topology->nodes.append(node);
+    topology->node_types.append(node->type);
+    LIST_FOREACH (NodeSocket *, sock, &node->inputs) {
+      socket_indices.add_new(sock, topology->input_sockets.append_and_get_index(sock));
+    }
+    topology->input_offsets.append(topology->input_sockets.size());
+    LIST_FOREACH (NodeSocket *, sock, &node->outputs) {
+      socket_indices.add_new(sock, topology->output_sockets.append_and_get_index(sock));
+    }
+    topology->output_offsets.append(topology->output_sockets.size());
+  }
+
+  LIST_FOREACH (NodeLink *, link, &ntree.links) {
+    topology->links.append(link);
+    topology->link_from_nodes.append(topology->node_indices.lookup(link->fromnode));
+    topology->link_to_nodes.append(topology->node_indices.lookup(link->tonode));
+    topology->link_from_sockets.append(socket_indices.lookup(link->fromsock));
+    topology->link_to_sockets.append(socket_indices.lookup(link->tosock));
+  }
+
+  runtime.topology = std::move(topology);
+  return *runtime.topology;
+}
+
+}  // namespace dune
+
 static NodeSocket *make_socket(NodeTree *ntree,
                                Node *UNUSED(node),
                                int in_out,
@@ -1722,6 +2167,8 @@ static NodeSocket *make_socket(NodeTree *ntree,
   lib_strncpy(sock->idname, idname, sizeof(sock->idname));
   node_socket_set_typeinfo(ntree, sock, nodeSocketTypeFind(idname));
 
+  dune::node_topology_changed(ntree);
+
   return sock;
 }
 
@@ -1880,6 +2327,18 @@ NodeSocket *nodeAddSocket(NodeTree *ntree,
   lib_remlink(lb, sock); /* does nothing for new socket */
   lib_addtail(lb, sock);
 
+  if (dune::NodeTreeRuntime *runtime = dune::node_socket_owners_get_if_valid(ntree)) {
+    const NodeSocket *prev = sock->prev;
+    const dune::NodeSocketOwner *prev_owner = prev ? runtime->socket_owners.lookup_ptr(prev) :
+                                                     nullptr;
+    if (prev == nullptr || prev_owner != nullptr) {
+      runtime->socket_owners.add_new(sock, {node, prev_owner ? prev_owner->index + 1 : 0});
+    }
+    else {
+      dune::node_tree_socket_owners_tag_dirty(*ntree);
+    }
+  }
+
   dune_ntree_update_tag_socket_new(ntree, sock);
 
   return sock;
@@ -2124,11 +2583,7 @@ void nodeRemoveSocketEx(struct NodeTree *ntree,
                         struct NodeSocket *sock,
                         bool do_id_user)
 {
-  LIST_FOREACH_MUTABLE (NodeLink *, link, &ntree->links) {
-    if (link->fromsock == sock || link->tosock == sock) {
-      nodeRemLink(ntree, link);
-    }
-  }
+  nodeRemSocketLinks(ntree, sock);
 
   LIST_FOREACH_MUTABLE (bNodeLink *, link, &node->internal_links) {
     if (link->fromsock == sock || link->tosock == sock) {
@@ -2138,10 +2593,28 @@ void nodeRemoveSocketEx(struct NodeTree *ntree,
     }
   }
 
+  dune::node_topology_changed(ntree);
+  if (dune::NodeTreeRuntime *runtime = dune::node_socket_owners_get_if_valid(ntree)) {
+    for (NodeSocket *next = sock->next; next; next = next->next) {
+      dune::NodeSocketOwner *owner = runtime->socket_owners.lookup_ptr(next);
+      if (owner == nullptr) {
+        /* Sockets added without going through the owner map, rebuild on next lookup. */
+        runtime->socket_owners_is_valid = false;
+        break;
+      }
+      owner->index--;
+    }
+    runtime->socket_owners.remove(sock);
+  }
+
   /* this is fast, this way we don't need an in_out argument */
   lib_remlink(&node->inputs, sock);
   lib_remlink(&node->outputs, sock);
 
+  if (dune::NodeTreeRuntime *runtime = dune::node_links_index_get_if_valid(ntree)) {
+    runtime->links_by_socket.remove(sock);
+  }
+
   node_socket_free(sock, do_id_user);
   mem_freen(sock);
 
@@ -2150,14 +2623,26 @@ void nodeRemoveSocketEx(struct NodeTree *ntree,
 
 void nodeRemoveAllSockets(NodeTree *ntree, Node *node)
 {
-  LIST_FOREACH_MUTABLE (NodeLink *, link, &ntree->links) {
-    if (link->fromnode == node || link->tonode == node) {
+  /* Copies, removing links edits the index. */
+  const Vector<NodeLink *> input_links = dune::node_input_links(*ntree, *node);
+  const Vector<NodeLink *> output_links = dune::node_output_links(*ntree, *node);
+  for (NodeLink *link : input_links) {
+    nodeRemLink(ntree, link);
+  }
+  for (NodeLink *link : output_links) {
+    /* Links from the node to itself are in both lists. */
+    if (link->tonode != node) {
       nodeRemLink(ntree, link);
     }
   }
 
   lib_freelistn(&node->internal_links);
 
+  dune::node_topology_changed(ntree);
+  if (dune::NodeTreeRuntime *runtime = dune::node_socket_owners_get_if_valid(ntree)) {
+    dune::node_socket_owners_remove_node(*runtime, node);
+  }
+
   LIST_FOREACH_MUTABLE (NodeSocket *, sock, &node->inputs) {
     node_socket_free(sock, true);
     mem_freen(sock);
@@ -2170,35 +2655,53 @@ void nodeRemoveAllSockets(NodeTree *ntree, Node *node)
   }
   lib_list_clear(&node->outputs);
 
+  if (dune::NodeTreeRuntime *runtime = dune::node_links_index_get_if_valid(ntree)) {
+    runtime->input_links_by_node.remove(node);
+    runtime->output_links_by_node.remove(node);
+  }
+
   BKE_ntree_update_tag_socket_removed(ntree);
 }
 
 Node *nodeFindNodebyName(NodeTree *ntree, const char *name)
 {
+  const dune::NodeTreeRuntime &runtime = dune::node_names_ensure(*ntree);
+  Node *node = runtime.nodes_by_name.lookup_default(name, nullptr);
+  if (node != nullptr && STREQ(node->name, name)) {
+    return node;
+  }
+  /* Not found, or the node was renamed without nodeUniqueName. */
   return (Node *)lib_findstring(&ntree->nodes, name, offsetof(Node, name));
 }
 
+/* Check the whole socket owners map against the tree on each lookup, very slow. */
+// #define USE_NODE_SOCKET_OWNERS_DEBUG_VALIDATE
+
+#ifdef USE_NODE_SOCKET_OWNERS_DEBUG_VALIDATE
+#  define NODE_SOCKET_OWNERS_DEBUG_VALIDATE(_ntree) \
+    lib_assert(dune::node_tree_socket_owners_validate(*(_ntree)))
+#else
+#  define NODE_SOCKET_OWNERS_DEBUG_VALIDATE(_ntree) ((void)0)
+#endif
+
 bool nodeFindNode(NodeTree *ntree, NodeSocket *sock, Node **r_node, int *r_sockindex)
 {
   *r_node = nullptr;
 
-  LIST_FOREACH (Node *, node, &ntree->nodes) {
-    List *sockets = (sock->in_out == SOCK_IN) ? &node->inputs : &node->outputs;
-    int index = 0;
-    LIST_FOREACH (NodeSocket *, tsock, sockets) {
-      if (sock == tsock) {
-        if (r_node != nullptr) {
-          *r_node = node;
-        }
-        if (r_sockindex != nullptr) {
-          *r_sockindex = index;
-        }
-        return true;
-      }
-      index++;
-    }
+  const dune::NodeTreeRuntime &runtime = dune::node_socket_owners_ensure(*ntree);
+  NODE_SOCKET_OWNERS_DEBUG_VALIDATE(ntree);
+
+  const dune::NodeSocketOwner *owner = runtime.socket_owners.lookup_ptr(sock);
+  if (owner == nullptr) {
+    return false;
   }
-  return false;
+  if (r_node != nullptr) {
+    *r_node = owner->node;
+  }
+  if (r_sockindex != nullptr) {
+    *r_sockindex = owner->index;
+  }
+  return true;
 }
 
 Node *nodeFindRootParent(Node *node)
@@ -2311,12 +2814,14 @@ void nodeUniqueName(NodeTree *ntree, Node *node)
 {
   lib_uniquename(
       &ntree->nodes, node, DATA_("Node"), '.', offsetof(Node, name), sizeof(node->name));
+  dune::node_names_changed(ntree);
 }
  
 Node *nodeAddNode(const struct Cxt *C, NodeTree *ntree, const char *idname)
 {
   Node *node = mem_cnew<Node>("new node");
   lib_addtail(&ntree->nodes, node);
+  dune::node_topology_changed(ntree);
 
   lib_strncpy(node->idname, idname, sizeof(node->idname));
   node_set_typeinfo(C, ntree, node, nodeTypeFind(idname));
@@ -2371,6 +2876,50 @@ static void node_socket_copy(NodeSocket *sock_dst, const NodeSocket *sock_src, c
   sock_dst->cache = nullptr;
 }
 
+/* Copy of `node_src` sharing its storage, properties and socket values instead of duplicating
+ * them, see dune::node_tree_localize. Only the node, its sockets and its internal links are
+ * allocated. */
+static Node *node_copy_shared_with_mapping(NodeTree *dst_tree,
+                                           const Node &node_src,
+                                           Map<const NodeSocket *, NodeSocket *> &socket_map)
+{
+  Node *node_dst = (Node *)mem_mallocn(sizeof(Node), __func__);
+  *node_dst = node_src;
+  lib_addtail(&dst_tree->nodes, node_dst);
+
+  auto copy_sockets = [&](ListBase &dst_sockets, const ListBase &src_sockets) {
+    lib_list_clear(&dst_sockets);
+    LIST_FOREACH (const NodeSocket *, src_socket, &src_sockets) {
+      NodeSocket *dst_socket = (NodeSocket *)mem_dupallocn(src_socket);
+      dst_socket->stack_index = 0;
+      dst_socket->cache = nullptr;
+      lib_addtail(&dst_sockets, dst_socket);
+      socket_map.add_new(src_socket, dst_socket);
+    }
+  };
+  copy_sockets(node_dst->inputs, node_src.inputs);
+  copy_sockets(node_dst->outputs, node_src.outputs);
+
+  lib_list_clear(&node_dst->internal_links);
+  LIST_FOREACH (const NodeLink *, src_link, &node_src.internal_links) {
+    NodeLink *dst_link = (NodeLink *)mem_dupallocn(src_link);
+    dst_link->fromnode = node_dst;
+    dst_link->tonode = node_dst;
+    dst_link->fromsock = socket_map.lookup(src_link->fromsock);
+    dst_link->tosock = socket_map.lookup(src_link->tosock);
+    lib_addtail(&node_dst->internal_links, dst_link);
+  }
+
+  dune::node_tree_runtime_ensure(*dst_tree).shared_nodes.add_new(node_dst);
+  dune::node_names_changed(dst_tree);
+  ntree_update_tag_node_new(dst_tree, node_dst);
+
+  node_dst->declaration = nullptr;
+  nodeDeclarationEnsure(dst_tree, node_dst);
+
+  return node_dst;
+}
+
 namespace dune {
 
 Node *node_copy_with_mapping(NodeTree *dst_tree,
@@ -2439,6 +2988,11 @@ Node *node_copy_with_mapping(NodeTree *dst_tree,
 
   if (dst_tree) {
     ntree_update_tag_node_new(dst_tree, node_dst);
+    if (NodeTreeRuntime *runtime = node_socket_owners_get_if_valid(dst_tree)) {
+      node_socket_owners_add_node(*runtime, node_dst);
+    }
+    node_topology_changed(dst_tree);
+    node_names_changed(dst_tree);
   }
 
   /* Reset the declaration of the new node. */
@@ -2461,13 +3015,7 @@ Node *node_copy(NodeTree *dst_tree,
 
 static int node_count_links(const NodeTree *ntree, const NodeSocket *socket)
 {
-  int count = 0;
-  LIST_FOREACH (NodeLink *, link, &ntree->links) {
-    if (ELEM(socket, link->fromsock, link->tosock)) {
-      count++;
-    }
-  }
-  return count;
+  return dune::node_socket_links(*ntree, *socket).size();
 }
 
 NodeLink *nodeAddLink(
@@ -2505,8 +3053,18 @@ NodeLink *nodeAddLink(
     ntree_update_tag_link_added(ntree, link);
   }
 
-  if (link != nullptr && link->tosock->flag & SOCK_MULTI_INPUT) {
-    link->multi_input_socket_index = node_count_links(ntree, link->tosock) - 1;
+  if (link != nullptr) {
+    const bool levels_were_valid = dune::node_levels_are_valid(ntree);
+    dune::node_topology_changed(ntree);
+    if (dune::NodeTreeRuntime *runtime = dune::node_links_index_get_if_valid(ntree)) {
+      dune::node_links_index_add(*runtime, link);
+    }
+    if (levels_were_valid) {
+      ntree->runtime->levels_are_valid = dune::node_levels_update_link_added(*ntree, *link);
+    }
+    if (ntree && link->tosock->flag & SOCK_MULTI_INPUT) {
+      link->multi_input_socket_index = node_count_links(ntree, link->tosock) - 1;
+    }
   }
 
   return link;
@@ -2518,6 +3076,15 @@ void nodeRemLink(NodeTree *ntree, NodeLink *link)
   if (ntree) {
     lib_remlink(&ntree->links, link);
   }
+  if (dune::NodeTreeRuntime *runtime = dune::node_links_index_get_if_valid(ntree)) {
+    dune::node_links_index_remove(*runtime, link);
+  }
+  const bool levels_were_valid = dune::node_levels_are_valid(ntree);
+  dune::node_topology_changed(ntree);
+  if (levels_were_valid) {
+    ntree->runtime->levels_are_valid = dune::node_levels_update_link_removed(*ntree,
+                                                                             *link->tonode);
+  }
 
   if (link->tosock) {
     link->tosock->link = nullptr;
@@ -2532,17 +3099,12 @@ void nodeRemLink(NodeTree *ntree, NodeLink *link)
 /* Check if all output links are muted or not. */
 static bool nodeMuteFromSocketLinks(const NodeTree *ntree, const NodeSocket *sock)
 {
-  int tot = 0;
-  int muted = 0;
-  LIST_FOREACH (const NodeLink *, link, &ntree->links) {
-    if (link->fromsock == sock) {
-      tot++;
-      if (link->flag & NODE_LINK_MUTED) {
-        muted++;
-      }
+  for (const NodeLink *link : dune::node_socket_links(*ntree, *sock)) {
+    if (link->fromsock == sock && !(link->flag & NODE_LINK_MUTED)) {
+      return false;
     }
   }
-  return tot == muted;
+  return true;
 }
 
 static void nodeMuteLink(NodeLink *link)
@@ -2561,7 +3123,7 @@ static void nodeUnMuteLink(NodeLink *link)
   link->tosock->flag |= SOCK_IN_USE;
 }
 
-/* Upstream muting. Always happens when unmuting but checks when muting. O(n^2) algorithm. */
+/* Upstream muting. Always happens when unmuting but checks when muting. */
 static void nodeMuteRerouteInputLinks(NodeTree *ntree, Node *node, const bool mute)
 {
   if (node->type != NODE_REROUTE) {
@@ -2569,7 +3131,7 @@ static void nodeMuteRerouteInputLinks(NodeTree *ntree, Node *node, const bool mu
   }
   if (!mute || nodeMuteFromSocketLinks(ntree, (NodeSocket *)node->outputs.first)) {
     NodeSocket *sock = (NodeSocket *)node->inputs.first;
-    LIST_FOREACH (NodeLink *, link, &ntree->links) {
+    for (NodeLink *link : dune::node_socket_links(*ntree, *sock)) {
       if (!(link->flag & NODE_LINK_VALID) || (link->tosock != sock)) {
         continue;
       }
@@ -2584,7 +3146,7 @@ static void nodeMuteRerouteInputLinks(NodeTree *ntree, Node *node, const bool mu
   }
 }
 
-/* Downstream muting propagates when reaching reroute nodes. O(n^2) algorithm. */
+/* Downstream muting propagates when reaching reroute nodes. */
 static void nodeMuteRerouteOutputLinks(NodeTree *ntree, Node *node, const bool mute)
 {
   if (node->type != NODE_REROUTE) {
@@ -2592,7 +3154,7 @@ static void nodeMuteRerouteOutputLinks(NodeTree *ntree, Node *node, const bool m
   }
   NodeSocket *sock;
   sock = (NodeSocket *)node->outputs.first;
-  LIST_FOREACH (NodeLink *, link, &ntree->links) {
+  for (NodeLink *link : dune::node_socket_links(*ntree, *sock)) {
     if (!(link->flag & NODE_LINK_VALID) || (link->fromsock != sock)) {
       continue;
     }
@@ -2631,10 +3193,10 @@ void nodeMuteLinkToggle(NodeTree *ntree, NodeLink *link)
 
 void nodeRemSocketLinks(NodeTree *ntree, NodeSocket *sock)
 {
-  LIST_FOREACH_MUTABLE (NodeLink *, link, &ntree->links) {
-    if (link->fromsock == sock || link->tosock == sock) {
-      nodeRemLink(ntree, link);
-    }
+  /* Copy, removing links edits the index. */
+  const Vector<NodeLink *> links = dune::node_socket_links(*ntree, *sock);
+  for (NodeLink *link : links) {
+    nodeRemLink(ntree, link);
   }
 }
 
@@ -2691,8 +3253,16 @@ void nodeInternalRelink(NodeTree *ntree, Node *node)
               }
             }
           }
+          dune::NodeTreeRuntime *runtime = dune::node_links_index_get_if_valid(ntree);
+          if (runtime) {
+            dune::node_links_index_remove(*runtime, link);
+          }
           link->fromnode = fromlink->fromnode;
           link->fromsock = fromlink->fromsock;
+          if (runtime) {
+            dune::node_links_index_add(*runtime, link);
+          }
+          dune::node_topology_changed(ntree);
 
           /* if the up- or downstream link is invalid,
            * the replacement link will be invalid too. */
@@ -2891,6 +3461,258 @@ bool node_preview_used(const Node *node)
   return (node->typeinfo->flag & NODE_PREVIEW) != 0;
 }
 
+/* Preview buffer pool.
+ *
+ * Preview rects are allocated in size classes (powers of two, starting at 4 KiB), a rect released
+ * by a preview is kept in the free list of its class and re-used by the next preview of that
+ * class, whatever node or tree it belongs to. Rects in use are kept in a least recently used
+ * list, when their total size goes over the budget, the rects of the least recently used previews
+ * of the tree being updated are released. Those previews stay valid without a rect, and get a new
+ * one the next time they are drawn into, see node_preview_verify. node_preview_init_tree only
+ * keeps previews of nodes whose preview is displayed, so evaluation never allocates rects for
+ * hidden previews.
+ *
+ * note Evicting a rect changes the preview it belongs to, so the budget is only enforced by
+ * node_preview_init_tree and dune_node_preview_remove_unused, and only on the previews of the
+ * tree they are called on. Rects of other trees, e.g. localized trees evaluated by a job, are
+ * never evicted from there. */
+
+#define NODE_PREVIEW_POOL_CLASS_MIN_SHIFT 12
+#define NODE_PREVIEW_POOL_CLASSES_NUM 20
+#define NODE_PREVIEW_POOL_BUDGET_DEFAULT ((size_t)64 * 1024 * 1024)
+
+/* Header stored right before the pixels of each preview rect. */
+struct NodePreviewBuffer {
+  /* Least recently used list while in use, free list of the size class otherwise. */
+  NodePreviewBuffer *prev, *next;
+  NodePreview *owner;
+  /* Previews of the tree `owner` is stored in, set when copying tree previews and when drawn
+   * into through node_preview_verify. Null for previews copied on their own until then, which
+   * are not evicted. */
+  const NodeInstanceHash *previews;
+  int size_class;
+  /* Requested size, the allocated size is the size of the class. */
+  size_t size;
+};
+
+static struct {
+  ThreadMutex mutex;
+  NodePreviewBuffer *free_lists[NODE_PREVIEW_POOL_CLASSES_NUM];
+  /* Rects in use, least recently used first. */
+  NodePreviewBuffer *lru_first, *lru_last;
+  /* Total size of rects in use, and of rects in the free lists. */
+  size_t used_size;
+  size_t free_size;
+  size_t budget;
+} node_preview_pool = {
+    LIB_MUTEX_INITIALIZER, {nullptr}, nullptr, nullptr, 0, 0, NODE_PREVIEW_POOL_BUDGET_DEFAULT};
+
+static size_t node_preview_pool_class_size(const int size_class)
+{
+  return (size_t)1 << (size_class + NODE_PREVIEW_POOL_CLASS_MIN_SHIFT);
+}
+
+static int node_preview_pool_size_class(const size_t size)
+{
+  int size_class = 0;
+  while (node_preview_pool_class_size(size_class) < size) {
+    size_class++;
+  }
+  lib_assert(size_class < NODE_PREVIEW_POOL_CLASSES_NUM);
+  return size_class;
+}
+
+static NodePreviewBuffer *node_preview_buffer_from_rect(unsigned char *rect)
+{
+  return (NodePreviewBuffer *)rect - 1;
+}
+
+/* Free lists are only kept up to a quarter of the budget, the rest is given back.
+ * Must be called with the pool mutex held. */
+static void node_preview_pool_buffer_discard(NodePreviewBuffer *buffer)
+{
+  const size_t class_size = node_preview_pool_class_size(buffer->size_class);
+  if (node_preview_pool.free_size + class_size > node_preview_pool.budget / 4) {
+    mem_freen(buffer);
+    return;
+  }
+  buffer->owner = nullptr;
+  buffer->previews = nullptr;
+  buffer->prev = nullptr;
+  buffer->next = node_preview_pool.free_lists[buffer->size_class];
+  node_preview_pool.free_lists[buffer->size_class] = buffer;
+  node_preview_pool.free_size += class_size;
+}
+
+/* Must be called with the pool mutex held. */
+static void node_preview_pool_lru_unlink(NodePreviewBuffer *buffer)
+{
+  if (buffer->prev) {
+    buffer->prev->next = buffer->next;
+  }
+  else {
+    node_preview_pool.lru_first = buffer->next;
+  }
+  if (buffer->next) {
+    buffer->next->prev = buffer->prev;
+  }
+  else {
+    node_preview_pool.lru_last = buffer->prev;
+  }
+  buffer->prev = buffer->next = nullptr;
+}
+
+/* Must be called with the pool mutex held. */
+static void node_preview_pool_lru_append(NodePreviewBuffer *buffer)
+{
+  buffer->prev = node_preview_pool.lru_last;
+  buffer->next = nullptr;
+  if (node_preview_pool.lru_last) {
+    node_preview_pool.lru_last->next = buffer;
+  }
+  else {
+    node_preview_pool.lru_first = buffer;
+  }
+  node_preview_pool.lru_last = buffer;
+}
+
+/* Get a zeroed rect of `size` bytes for `owner`, stored in `previews` (may be null). */
+static unsigned char *node_preview_buffer_acquire(NodePreview *owner,
+                                                  const NodeInstanceHash *previews,
+                                                  const size_t size)
+{
+  const int size_class = node_preview_pool_size_class(size);
+  const size_t class_size = node_preview_pool_class_size(size_class);
+
+  lib_mutex_lock(&node_preview_pool.mutex);
+  NodePreviewBuffer *buffer = node_preview_pool.free_lists[size_class];
+  if (buffer) {
+    node_preview_pool.free_lists[size_class] = buffer->next;
+    node_preview_pool.free_size -= class_size;
+  }
+  else {
+    buffer = (NodePreviewBuffer *)mem_mallocn(sizeof(NodePreviewBuffer) + class_size,
+                                              "node preview rect");
+  }
+  buffer->owner = owner;
+  buffer->previews = previews;
+  buffer->size_class = size_class;
+  buffer->size = size;
+  node_preview_pool_lru_append(buffer);
+  node_preview_pool.used_size += class_size;
+  lib_mutex_unlock(&node_preview_pool.mutex);
+
+  unsigned char *rect = (unsigned char *)(buffer + 1);
+  memset(rect, 0, size);
+  return rect;
+}
+
+static void node_preview_buffer_release(unsigned char *rect)
+{
+  NodePreviewBuffer *buffer = node_preview_buffer_from_rect(rect);
+  lib_mutex_lock(&node_preview_pool.mutex);
+  node_preview_pool_lru_unlink(buffer);
+  node_preview_pool.used_size -= node_preview_pool_class_size(buffer->size_class);
+  node_preview_pool_buffer_discard(buffer);
+  lib_mutex_unlock(&node_preview_pool.mutex);
+}
+
+/* Mark the rect as most recently used, by a preview stored in `previews`. */
+static void node_preview_buffer_touch(unsigned char *rect, const NodeInstanceHash *previews)
+{
+  NodePreviewBuffer *buffer = node_preview_buffer_from_rect(rect);
+  lib_mutex_lock(&node_preview_pool.mutex);
+  buffer->previews = previews;
+  if (buffer != node_preview_pool.lru_last) {
+    node_preview_pool_lru_unlink(buffer);
+    node_preview_pool_lru_append(buffer);
+  }
+  lib_mutex_unlock(&node_preview_pool.mutex);
+}
+
+static size_t node_preview_buffer_size(unsigned char *rect)
+{
+  return node_preview_buffer_from_rect(rect)->size;
+}
+
+/* Move the rect to another previews hash, when merging previews. */
+static void node_preview_buffer_set_previews(unsigned char *rect, const NodeInstanceHash *previews)
+{
+  NodePreviewBuffer *buffer = node_preview_buffer_from_rect(rect);
+  lib_mutex_lock(&node_preview_pool.mutex);
+  buffer->previews = previews;
+  lib_mutex_unlock(&node_preview_pool.mutex);
+}
+
+/* Release least recently used rects of `previews` while over the budget (none when `previews` is
+ * null), and trim the free lists. */
+static void node_preview_pool_enforce_budget(const NodeInstanceHash *previews)
+{
+  lib_mutex_lock(&node_preview_pool.mutex);
+  NodePreviewBuffer *buffer_next;
+  for (NodePreviewBuffer *buffer = node_preview_pool.lru_first;
+       buffer && previews && node_preview_pool.used_size > node_preview_pool.budget;
+       buffer = buffer_next)
+  {
+    buffer_next = buffer->next;
+    if (buffer->previews != previews) {
+      continue;
+    }
+    node_preview_pool_lru_unlink(buffer);
+    node_preview_pool.used_size -= node_preview_pool_class_size(buffer->size_class);
+    buffer->owner->rect = nullptr;
+    node_preview_pool_buffer_discard(buffer);
+  }
+  /* The budget may have been lowered, trim the free lists starting with the largest rects. */
+  for (int size_class = NODE_PREVIEW_POOL_CLASSES_NUM - 1;
+       size_class >= 0 && node_preview_pool.free_size > node_preview_pool.budget / 4;
+       size_class--)
+  {
+    while (node_preview_pool.free_lists[size_class] &&
+           node_preview_pool.free_size > node_preview_pool.budget / 4) {
+      NodePreviewBuffer *buffer = node_preview_pool.free_lists[size_class];
+      node_preview_pool.free_lists[size_class] = buffer->next;
+      node_preview_pool.free_size -= node_preview_pool_class_size(size_class);
+      mem_freen(buffer);
+    }
+  }
+  lib_mutex_unlock(&node_preview_pool.mutex);
+}
+
+namespace dune {
+
+void node_preview_pool_budget_set(const size_t budget)
+{
+  lib_mutex_lock(&node_preview_pool.mutex);
+  node_preview_pool.budget = budget;
+  lib_mutex_unlock(&node_preview_pool.mutex);
+  /* Rects in use are only released by the next update of their tree. */
+  node_preview_pool_enforce_budget(nullptr);
+}
+
+size_t node_preview_pool_used_size()
+{
+  lib_mutex_lock(&node_preview_pool.mutex);
+  const size_t used_size = node_preview_pool.used_size;
+  lib_mutex_unlock(&node_preview_pool.mutex);
+  return used_size;
+}
+
+void node_preview_pool_free()
+{
+  lib_mutex_lock(&node_preview_pool.mutex);
+  for (int size_class = 0; size_class < NODE_PREVIEW_POOL_CLASSES_NUM; size_class++) {
+    while (NodePreviewBuffer *buffer = node_preview_pool.free_lists[size_class]) {
+      node_preview_pool.free_lists[size_class] = buffer->next;
+      mem_freen(buffer);
+    }
+  }
+  node_preview_pool.free_size = 0;
+  lib_mutex_unlock(&node_preview_pool.mutex);
+}
+
+}  // namespace dune
+
 NodePreview *node_preview_verify(NodeInstanceHash *previews,
                                  NodeInstanceKey key,
                                  const int xsize,
@@ -2916,39 +3738,71 @@ NodePreview *node_preview_verify(NodeInstanceHash *previews,
   /* sanity checks & initialize */
   if (preview->rect) {
     if (preview->xsize != xsize || preview->ysize != ysize) {
-      mem_freen(preview->rect);
+      node_preview_buffer_release(preview->rect);
       preview->rect = nullptr;
     }
   }
 
   if (preview->rect == nullptr) {
-    preview->rect = (unsigned char *)mem_callocn(4 * xsize + xsize * ysize * sizeof(char[4]),
-                                                 "node preview rect");
+    preview->rect = node_preview_buffer_acquire(
+        preview, previews, 4 * (size_t)xsize + (size_t)xsize * ysize * sizeof(char[4]));
     preview->xsize = xsize;
     preview->ysize = ysize;
   }
+  else {
+    node_preview_buffer_touch(preview->rect, previews);
+  }
   /* no clear, makes nicer previews */
 
   return preview;
 }
 
-NodePreview *dune_node_preview_copy(NodePreview *preview)
+/* Copy a preview that will be stored in `previews`, null when not known yet. */
+static NodePreview *node_preview_copy_ex(NodePreview *preview, const NodeInstanceHash *previews)
 {
   NodePreview *new_preview = (NodePreview *)mem_dupallocn(preview);
   if (preview->rect) {
-    new_preview->rect = (unsigned char *)mem_dupallocn(preview->rect);
+    const size_t size = node_preview_buffer_size(preview->rect);
+    new_preview->rect = node_preview_buffer_acquire(new_preview, previews, size);
+    memcpy(new_preview->rect, preview->rect, size);
   }
   return new_preview;
 }
 
+NodePreview *dune_node_preview_copy(NodePreview *preview)
+{
+  /* The rect is only evicted once the copy has been drawn into through a previews hash. */
+  return node_preview_copy_ex(preview, nullptr);
+}
+
+/* Copy all previews of a tree, their rects count toward the budget of the new hash right away,
+ * so that copied trees are evicted like any other. */
+static NodeInstanceHash *node_previews_copy(NodeInstanceHash *previews_src)
+{
+  NodeInstanceHash *previews = node_instance_hash_new("node previews");
+  NodeInstanceHashIter iter;
+  NODE_INSTANCE_HASH_ITER (iter, previews_src) {
+    NodeInstanceKey key = node_instance_hash_iter_get_key(&iter);
+    NodePreview *preview = (NodePreview *)node_instance_hash_iter_get_value(&iter);
+    node_instance_hash_insert(previews, key, node_preview_copy_ex(preview, previews));
+  }
+  return previews;
+}
+
 void node_preview_free(NodePreview *preview)
 {
   if (preview->rect) {
-    mem_freeb(preview->rect);
+    node_preview_buffer_release(preview->rect);
   }
   mem_freen(preview);
 }
 
+/* Whether the preview of the node is shown in the editor, only those get a rect. */
+static bool node_preview_displayed(const Node *node)
+{
+  return node_preview_used(node) && (node->flag & NODE_PREVIEW) && !(node->flag & NODE_HIDDEN);
+}
+
 static void node_preview_init_tree_recursive(NodeInstanceHash *previews,
                                              NodeTree *ntree,
                                              NodeInstanceKey parent_key,
@@ -2958,11 +3812,21 @@ static void node_preview_init_tree_recursive(NodeInstanceHash *previews,
   LIST_FOREACH (Node *, node, &ntree->nodes) {
     NodeInstanceKey key = node_instance_key(parent_key, ntree, node);
 
-    if (dune_node_preview_used(node)) {
+    if (node_preview_displayed(node)) {
       node->preview_xsize = xsize;
       node->preview_ysize = ysize;
 
-      node_preview_verify(previews, key, xsize, ysize, false);
+      /* Only create the preview and drop rects of the wrong size. Rects are allocated when
+       * displayed previews are written to by evaluation, see node_preview_verify. */
+      NodePreview *preview = node_preview_verify(previews, key, 0, 0, true);
+      if (preview->rect && (preview->xsize != xsize || preview->ysize != ysize)) {
+        node_preview_buffer_release(preview->rect);
+        preview->rect = nullptr;
+      }
+    }
+    else {
+      /* Evaluation only writes previews that exist, so hidden previews never get a rect. */
+      node_instance_hash_remove(previews, key, (NodeInstanceValueFP)node_preview_free);
     }
 
     if (node->type == NODE_GROUP && node->id) {
@@ -2982,6 +3846,7 @@ void node_preview_init_tree(NodeTree *ntree, int xsize, int ysize)
   }
 
   node_preview_init_tree_recursive(ntree->previews, ntree, NODE_INSTANCE_KEY_BASE, xsize, ysize);
+  node_preview_pool_enforce_budget(ntree->previews);
 }
 
 static void node_preview_tag_used_recursive(NodeInstanceHash *previews,
@@ -3013,12 +3878,13 @@ void dune_node_preview_remove_unused(NodeTree *ntree)
 
   node_instance_hash_remove_untagged(ntree->previews,
                                          (NodeInstanceValueFP)dune_node_preview_free);
+  node_preview_pool_enforce_budget(ntree->previews);
 }
 
 void node_preview_clear(NodePreview *preview)
 {
   if (preview && preview->rect) {
-    memset(preview->rect, 0, mem_allocn_len(preview->rect));
+    memset(preview->rect, 0, node_preview_buffer_size(preview->rect));
   }
 }
 
@@ -3060,6 +3926,9 @@ void node_preview_merge_tree(NodeTree *to_ntree, NodeTree *from_ntree, bool remo
         node_instance_hash_remove(
             to_ntree->previews, key, (NodeInstanceValueFP)node_preview_free);
         node_instance_hash_insert(to_ntree->previews, key, preview);
+        if (preview->rect) {
+          node_preview_buffer_set_previews(preview->rect, to_ntree->previews);
+        }
       }
 
       /* NOTE: null free function here,
@@ -3129,6 +3998,27 @@ static void node_free_node(NodeTree *ntree, Node *node)
       ntreeTexEndExTree(ntree->exdata);
       ntree->exdata = nullptr;
     }
+
+    if (dune::NodeTreeRuntime *runtime = dune::node_links_index_get_if_valid(ntree)) {
+      LIST_FOREACH (NodeSocket *, sock, &node->inputs) {
+        runtime->links_by_socket.remove(sock);
+      }
+      LIST_FOREACH (NodeSocket *, sock, &node->outputs) {
+        runtime->links_by_socket.remove(sock);
+      }
+      runtime->input_links_by_node.remove(node);
+      runtime->output_links_by_node.remove(node);
+    }
+    if (dune::NodeTreeRuntime *runtime = dune::node_socket_owners_get_if_valid(ntree)) {
+      dune::node_socket_owners_remove_node(*runtime, node);
+    }
+    dune::node_topology_changed(ntree);
+    dune::node_names_changed(ntree);
+    if (ntree->runtime) {
+      if (ntree->runtime->shared_nodes.remove(node)) {
+        node_local_shared_data_detach(node);
+      }
+    }
   }
 
   if (node->typeinfo->freefunc) {
@@ -3261,6 +4151,17 @@ static void free_localized_node_groups(NodeTree *ntree)
     return;
   }
 
+  if (ntree->runtime && ntree->runtime->local_groups_are_shared) {
+    /* Copy-on-write localization shares group trees between all group nodes using them, at any
+     * depth, so they are all owned by the top-most localized tree. */
+    for (NodeTree *ngroup : ntree->runtime->local_group_trees) {
+      ntreeFreeTree(ngroup);
+      mem_freen(ngroup);
+    }
+    ntree->runtime->local_group_trees.clear();
+    return;
+  }
+
   LIST_FOREACH (Node *, node, &ntree->nodes) {
     if (ELEM(node->type, NODE_GROUP, NODE_CUSTOM_GROUP) && node->id) {
       NodeTree *ngroup = (NodeTree *)node->id;
@@ -3270,6 +4171,32 @@ static void free_localized_node_groups(NodeTree *ntree)
   }
 }
 
+/* Forget about data shared with the original tree, so that freeing the node does not free it. */
+static void node_local_shared_data_detach(Node *node)
+{
+  LIST_FOREACH (NodeSocket *, sock, &node->inputs) {
+    sock->prop = nullptr;
+    sock->default_value = nullptr;
+  }
+  LIST_FOREACH (NodeSocket *, sock, &node->outputs) {
+    sock->prop = nullptr;
+    sock->default_value = nullptr;
+  }
+  node->prop = nullptr;
+  node->storage = nullptr;
+}
+
+static void node_local_shared_data_detach_all(NodeTree *ntree)
+{
+  if (ntree->runtime == nullptr) {
+    return;
+  }
+  for (const Node *node : ntree->runtime->shared_nodes) {
+    node_local_shared_data_detach(const_cast<Node *>(node));
+  }
+  ntree->runtime->shared_nodes.clear();
+}
+
 void ntreeFreeTree(NodeTree *ntree)
 {
   ntree_free_data(&ntree->id);
@@ -3413,22 +4340,42 @@ void ntreeNodeFlagSet(const NodeTree *ntree, const int flag, const bool enable)
   }
 }
 
-NodeTree *ntreeLocalize(NodeTree *ntree)
-{
-  if (ntree == nullptr) {
-    return nullptr;
-  }
+namespace dune {
 
-  /* Make full copy outside of Main database.
+static NodeTree *node_tree_localize_recursive(NodeTree *ntree,
+                                              const bool copy_on_write,
+                                              Map<const NodeTree *, NodeTree *> &local_groups)
+{
+  /* Make copy outside of Main database.
    * NOTE: previews are not copied here. */
-  NodeTree *ltree = (NodeTree *)dune_id_copy_ex(
-      nullptr, &ntree->id, nullptr, (LIB_ID_COPY_LOCALIZE | LIB_ID_COPY_NO_ANIMDATA));
+  int flag = LIB_ID_COPY_LOCALIZE | LIB_ID_COPY_NO_ANIMDATA;
+  if (copy_on_write) {
+    flag |= LIB_ID_COPY_NODETREE_SHARE_DATA;
+  }
+  NodeTree *ltree = (NodeTree *)dune_id_copy_ex(nullptr, &ntree->id, nullptr, flag);
 
   ltree->id.tag |= LIB_TAG_LOCALIZED;
+  if (copy_on_write) {
+    node_tree_runtime_ensure(*ltree).local_groups_are_shared = true;
+  }
 
   LIST_FOREACH (Node *, node, &ltree->nodes) {
     if (ELEM(node->type, NODE_GROUP, NODE_CUSTOM_GROUP) && node->id) {
-      node->id = (Id *)ntreeLocalize((bNodeTree *)node->id);
+      if (!copy_on_write) {
+        /* Each group node owns its own copy, freed by free_localized_node_groups. */
+        node->id = (Id *)node_tree_localize_recursive(
+            (NodeTree *)node->id, copy_on_write, local_groups);
+        continue;
+      }
+      const NodeTree *ngroup = (const NodeTree *)node->id;
+      /* Not lookup_or_add_cb, localizing the group adds to the map. */
+      NodeTree *local_group = local_groups.lookup_default(ngroup, nullptr);
+      if (local_group == nullptr) {
+        local_group = node_tree_localize_recursive(
+            (NodeTree *)node->id, copy_on_write, local_groups);
+        local_groups.add_new(ngroup, local_group);
+      }
+      node->id = (Id *)local_group;
     }
   }
 
@@ -3444,12 +4391,76 @@ NodeTree *ntreeLocalize(NodeTree *ntree)
   }
 
   if (ntree->typeinfo->localize) {
+    /* Callbacks get shared nodes, they only change the nodes themselves and their links, or
+     * remove nodes, which is safe. Writing node storage, properties or socket values requires
+     * node_local_ensure_owned on that node first. */
     ntree->typeinfo->localize(ltree, ntree);
   }
 
   return ltree;
 }
 
+NodeTree *node_tree_localize(NodeTree *ntree, const bool copy_on_write)
+{
+  if (ntree == nullptr) {
+    return nullptr;
+  }
+
+  Map<const NodeTree *, NodeTree *> local_groups;
+  NodeTree *ltree = node_tree_localize_recursive(ntree, copy_on_write, local_groups);
+  if (copy_on_write && !local_groups.is_empty()) {
+    Vector<NodeTree *> &local_group_trees = node_tree_runtime_ensure(*ltree).local_group_trees;
+    for (NodeTree *local_group : local_groups.values()) {
+      local_group_trees.append(local_group);
+    }
+  }
+  return ltree;
+}
+
+bool node_local_is_shared(const NodeTree &ltree, const Node &node)
+{
+  return ltree.runtime && ltree.runtime->shared_nodes.contains(&node);
+}
+
+void node_local_ensure_owned(NodeTree &ltree, Node &node)
+{
+  if (ltree.runtime == nullptr || !ltree.runtime->shared_nodes.remove(&node)) {
+    return;
+  }
+
+  const int flag = LIB_ID_CREATE_NO_MAIN | LIB_ID_CREATE_NO_USER_REFCOUNT;
+  auto copy_socket_values = [&](ListBase &sockets) {
+    LIST_FOREACH (NodeSocket *, sock, &sockets) {
+      if (sock->prop) {
+        sock->prop = IDP_CopyProp_ex(sock->prop, flag);
+      }
+      if (sock->default_value) {
+        sock->default_value = mem_dupallocn(sock->default_value);
+      }
+    }
+  };
+  copy_socket_values(node.inputs);
+  copy_socket_values(node.outputs);
+
+  if (node.prop) {
+    node.prop = IDP_CopyProp_ex(node.prop, flag);
+  }
+
+  if (node.typeinfo->copyfn) {
+    /* Storage is still the one of the original node, copy it like a regular node copy. */
+    lib_assert(node.original != nullptr);
+    node.typeinfo->copyfn(&ltree, &node, node.original);
+  }
+}
+
+}  // namespace dune
+
+NodeTree *ntreeLocalize(NodeTree *ntree)
+{
+  /* The original tree is left unchanged until the local tree is merged back or freed. */
+  return dune::node_tree_localize(ntree, true);
+}
+
 void ntreeLocalMerge(Main *main, NodeTree *localtree, NodeTree *ntree)
 {
   if (ntree && localtree) {
@@ -3737,7 +4748,7 @@ bool ntreeHasTree(const NodeTree *ntree, const NodeTree *lookup)
 
 NodeLink *nodeFindLink(NodeTree *ntree, const NodeSocket *from, const NodeSocket *to)
 {
-  LIST_FOREACH (NodeLink *, link, &ntree->links) {
+  for (NodeLink *link : dune::node_socket_links(*ntree, *from)) {
     if (link->fromsock == from && link->tosock == to) {
       return link;
     }
@@ -3750,13 +4761,7 @@ NodeLink *nodeFindLink(NodeTree *ntree, const NodeSocket *from, const NodeSocket
 
 int nodeCountSocketLinks(const NodeTree *ntree, const NodeSocket *sock)
 {
-  int tot = 0;
-  LIST_FOREACH (const NodeLink *, link, &ntree->links) {
-    if (link->fromsock == sock || link->tosock == sock) {
-      tot++;
-    }
-  }
-  return tot;
+  return dune::node_socket_links(*ntree, *sock).size();
 }
 
 Node *nodeGetActive(NodeTree *ntree)
@@ -4085,97 +5090,243 @@ NodeInstanceKey node_instance_key(NodeInstanceKey parent_key,
   return key;
 }
 
-static unsigned int node_instance_hash_key(const void *key)
+/* The instance hash is a flat open-addressing table with linear probing. The state and the tag
+ * of each entry are stored in its slot, so that tagging and removing untagged entries never has
+ * to look at the values. Removed entries leave a tombstone, cleaned up when the table grows. */
+enum {
+  NODE_INSTANCE_SLOT_EMPTY = 0,
+  NODE_INSTANCE_SLOT_REMOVED = (1 << 0),
+  NODE_INSTANCE_SLOT_USED = (1 << 1),
+  NODE_INSTANCE_SLOT_TAG = (1 << 2),
+};
+
+struct NodeInstanceHashSlot {
+  NodeInstanceKey key;
+  uint32_t flag;
+  void *value;
+};
+
+struct NodeInstanceHash {
+  NodeInstanceHashSlot *slots;
+  /* Number of slots minus one, the number of slots is a power of two. */
+  uint32_t slots_mask;
+  int used_num;
+  int removed_num;
+};
+
+#define NODE_INSTANCE_HASH_SLOTS_MIN 16
+
+static uint32_t node_instance_hash_slot_first(const NodeInstanceHash *hash,
+                                              const NodeInstanceKey key)
 {
-  return ((const NodeInstanceKey *)key)->value;
+  /* Keys are djb2 hashes of names, whose low bits are poorly distributed. */
+  uint32_t h = key.value * 0x9E3779B1u;
+  h ^= h >> 16;
+  return h & hash->slots_mask;
 }
 
-static bool node_instance_hash_key_cmp(const void *a, const void *b)
+static NodeInstanceHashSlot *node_instance_hash_slot_find(const NodeInstanceHash *hash,
+                                                          const NodeInstanceKey key)
 {
-  unsigned int value_a = ((const NodeInstanceKey *)a)->value;
-  unsigned int value_b = ((const NodeInstanceKey *)b)->value;
+  for (uint32_t i = node_instance_hash_slot_first(hash, key);; i = (i + 1) & hash->slots_mask) {
+    NodeInstanceHashSlot *slot = &hash->slots[i];
+    if (slot->flag == NODE_INSTANCE_SLOT_EMPTY) {
+      return nullptr;
+    }
+    if ((slot->flag & NODE_INSTANCE_SLOT_USED) && slot->key.value == key.value) {
+      return slot;
+    }
+  }
+}
 
-  return (value_a != value_b);
+static void node_instance_hash_slots_alloc(NodeInstanceHash *hash, const uint32_t slots_num)
+{
+  hash->slots = (NodeInstanceHashSlot *)mem_callocn(sizeof(NodeInstanceHashSlot) * slots_num,
+                                                     "node instance hash slots");
+  hash->slots_mask = slots_num - 1;
+  hash->removed_num = 0;
+}
+
+/* Make room for one more entry, rebuilding the table without tombstones when it is 3/4 full. */
+static void node_instance_hash_reserve_one(NodeInstanceHash *hash)
+{
+  const uint32_t slots_num = hash->slots_mask + 1;
+  if (uint32_t(hash->used_num + hash->removed_num + 1) * 4 <= slots_num * 3) {
+    return;
+  }
+
+  uint32_t new_slots_num = NODE_INSTANCE_HASH_SLOTS_MIN;
+  while (new_slots_num < uint32_t(hash->used_num + 1) * 2) {
+    new_slots_num *= 2;
+  }
+
+  NodeInstanceHashSlot *old_slots = hash->slots;
+  node_instance_hash_slots_alloc(hash, new_slots_num);
+  for (uint32_t i = 0; i < slots_num; i++) {
+    if (old_slots[i].flag & NODE_INSTANCE_SLOT_USED) {
+      uint32_t j = node_instance_hash_slot_first(hash, old_slots[i].key);
+      while (hash->slots[j].flag != NODE_INSTANCE_SLOT_EMPTY) {
+        j = (j + 1) & hash->slots_mask;
+      }
+      hash->slots[j] = old_slots[i];
+    }
+  }
+  mem_freen(old_slots);
+}
+
+static void node_instance_hash_slot_remove(NodeInstanceHash *hash, NodeInstanceHashSlot *slot)
+{
+  slot->flag = NODE_INSTANCE_SLOT_REMOVED;
+  slot->value = nullptr;
+  hash->used_num--;
+  hash->removed_num++;
 }
 
 NodeInstanceHash *node_instance_hash_new(const char *info)
 {
   NodeInstanceHash *hash = (NodeInstanceHash *)mem_mallocn(sizeof(NodeInstanceHash), info);
-  hash->ghash = lib_ghash_new(
-      node_instance_hash_key, node_instance_hash_key_cmp, "node instance hash ghash");
+  node_instance_hash_slots_alloc(hash, NODE_INSTANCE_HASH_SLOTS_MIN);
+  hash->used_num = 0;
   return hash;
 }
 
 void node_instance_hash_free(NodeInstanceHash *hash, NodeInstanceValueFP valfreefp)
 {
-  lib_ghash_free(hash->ghash, nullptr, (GHashValFreeFP)valfreefp);
+  dune_node_instance_hash_clear(hash, valfreefp);
+  mem_freen(hash->slots);
   mem_freen(hash);
 }
 
 void node_instance_hash_insert(NodeInstanceHash *hash, NodeInstanceKey key, void *value)
 {
+  lib_assert(node_instance_hash_slot_find(hash, key) == nullptr);
   NodeInstanceHashEntry *entry = (NodeInstanceHashEntry *)value;
   entry->key = key;
-  entry->tag = 0;
-  lib_ghash_insert(hash->ghash, &entry->key, value);
+
+  node_instance_hash_reserve_one(hash);
+  uint32_t i = node_instance_hash_slot_first(hash, key);
+  while (hash->slots[i].flag & NODE_INSTANCE_SLOT_USED) {
+    i = (i + 1) & hash->slots_mask;
+  }
+  NodeInstanceHashSlot *slot = &hash->slots[i];
+  if (slot->flag == NODE_INSTANCE_SLOT_REMOVED) {
+    hash->removed_num--;
+  }
+  slot->key = key;
+  slot->flag = NODE_INSTANCE_SLOT_USED;
+  slot->value = value;
+  hash->used_num++;
 }
 
 void *node_instance_hash_lookup(NodeInstanceHash *hash, NodeInstanceKey key)
 {
-  return lib_ghash_lookup(hash->ghash, &key);
+  NodeInstanceHashSlot *slot = node_instance_hash_slot_find(hash, key);
+  return slot ? slot->value : nullptr;
 }
 
 int node_instance_hash_remove(NodeInstanceHash *hash,
                               NodeInstanceKey key,
                               NodeInstanceValueFP valfreefp)
 {
-  return lib_ghash_remove(hash->ghash, &key, nullptr, (GHashValFreeFP)valfreefp);
+  NodeInstanceHashSlot *slot = node_instance_hash_slot_find(hash, key);
+  if (slot == nullptr) {
+    return false;
+  }
+  if (valfreefp) {
+    valfreefp(slot->value);
+  }
+  node_instance_hash_slot_remove(hash, slot);
+  return true;
 }
 
 void dune_node_instance_hash_clear(NodeInstanceHash *hash, NodeInstanceValueFP valfreefp)
 {
-  lib_ghash_clear(hash->ghash, nullptr, (GHashValFreeFP)valfreefp);
+  const uint32_t slots_num = hash->slots_mask + 1;
+  if (valfreefp) {
+    for (uint32_t i = 0; i < slots_num; i++) {
+      if (hash->slots[i].flag & NODE_INSTANCE_SLOT_USED) {
+        valfreefp(hash->slots[i].value);
+      }
+    }
+  }
+  memset(hash->slots, 0, sizeof(NodeInstanceHashSlot) * slots_num);
+  hash->used_num = 0;
+  hash->removed_num = 0;
 }
 
 void *node_instance_hash_pop(NodeInstanceHash *hash, NodeInstanceKey key)
 {
-  return lib_ghash_popkey(hash->ghash, &key, nullptr);
+  NodeInstanceHashSlot *slot = node_instance_hash_slot_find(hash, key);
+  if (slot == nullptr) {
+    return nullptr;
+  }
+  void *value = slot->value;
+  node_instance_hash_slot_remove(hash, slot);
+  return value;
 }
 
 int node_instance_hash_haskey(NodeInstanceHash *hash, NodeInstanceKey key)
 {
-  return lib_ghash_haskey(hash->ghash, &key);
+  return node_instance_hash_slot_find(hash, key) != nullptr;
 }
 
 int node_instance_hash_size(NodeInstanceHash *hash)
 {
-  return lib_ghash_len(hash->ghash);
+  return hash->used_num;
 }
 
-void node_instance_hash_clear_tags(NodeInstanceHash *hash)
+void node_instance_hash_iter_init(NodeInstanceHashIter *iter, NodeInstanceHash *hash)
+{
+  iter->hash = hash;
+  iter->index = -1;
+  node_instance_hash_iter_step(iter);
+}
+
+void node_instance_hash_iter_step(NodeInstanceHashIter *iter)
+{
+  const int slots_num = int(iter->hash->slots_mask + 1);
+  do {
+    iter->index++;
+  } while (iter->index < slots_num &&
+           !(iter->hash->slots[iter->index].flag & NODE_INSTANCE_SLOT_USED));
+}
+
+bool node_instance_hash_iter_done(const NodeInstanceHashIter *iter)
+{
+  return iter->index > int(iter->hash->slots_mask);
+}
+
+NodeInstanceKey node_instance_hash_iter_get_key(const NodeInstanceHashIter *iter)
 {
-  NodeInstanceHashIterator iter;
+  return iter->hash->slots[iter->index].key;
+}
 
-  NODE_INSTANCE_HASH_ITER (iter, hash) {
-    NodeInstanceHashEntry *value = (NodeInstanceHashEntry *)
-        node_instance_hash_iterator_get_value(&iter);
+void *node_instance_hash_iter_get_value(const NodeInstanceHashIter *iter)
+{
+  return iter->hash->slots[iter->index].value;
+}
 
-    value->tag = 0;
+void node_instance_hash_clear_tags(NodeInstanceHash *hash)
+{
+  for (uint32_t i = 0; i <= hash->slots_mask; i++) {
+    hash->slots[i].flag &= ~NODE_INSTANCE_SLOT_TAG;
   }
 }
 
-void node_instance_hash_tag(NodeInstanceHash *UNUSED(hash), void *value)
+void node_instance_hash_tag(NodeInstanceHash *hash, void *value)
 {
   NodeInstanceHashEntry *entry = (NodeInstanceHashEntry *)value;
-  entry->tag = 1;
+  NodeInstanceHashSlot *slot = node_instance_hash_slot_find(hash, entry->key);
+  lib_assert(slot && slot->value == value);
+  slot->flag |= NODE_INSTANCE_SLOT_TAG;
 }
 
 bool node_instance_hash_tag_key(NodeInstanceHash *hash, NodeInstanceKey key)
 {
-  NodeInstanceHashEntry *entry = (NodeInstanceHashEntry *)node_instance_hash_lookup(hash, key);
+  NodeInstanceHashSlot *slot = node_instance_hash_slot_find(hash, key);
 
-  if (entry) {
-    entry->tag = 1;
+  if (slot) {
+    slot->flag |= NODE_INSTANCE_SLOT_TAG;
     return true;
   }
 
@@ -4185,67 +5336,142 @@ bool node_instance_hash_tag_key(NodeInstanceHash *hash, NodeInstanceKey key)
 void node_instance_hash_remove_untagged(NodeInstanceHash *hash,
                                         NodeInstanceValueFP valfreefp)
 {
-  /* NOTE: Hash must not be mutated during iterating!
-   * Store tagged entries in a separate list and remove items afterward */
-  NodeInstanceKey *untagged = (NodeInstanceKey *)mem_mallocn(
-      sizeof(NodeInstanceKey) * node_instance_hash_size(hash),
-      "temp node instance key list");
-  NodeInstanceHashIter iter;
-  int num_untagged = 0;
-  NODE_INSTANCE_HASH_ITER (iter, hash) {
-    NodeInstanceHashEntry *value = (NodeInstanceHashEntry *)
-        node_instance_hash_iter_get_value(&iter);
-
-    if (!value->tag) {
-      untagged[num_untagged++] = node_instance_hash_iter_get_key(&iter);
+  for (uint32_t i = 0; i <= hash->slots_mask; i++) {
+    NodeInstanceHashSlot *slot = &hash->slots[i];
+    if ((slot->flag & NODE_INSTANCE_SLOT_USED) && !(slot->flag & NODE_INSTANCE_SLOT_TAG)) {
+      if (valfreefp) {
+        valfreefp(slot->value);
+      }
+      node_instance_hash_slot_remove(hash, slot);
     }
   }
-
-  for (int i = 0; i < num_untagged; i++) {
-    node_instance_hash_remove(hash, untagged[i], valfreefp);
-  }
-
-  mem_freen(untagged);
 }
 
 /* dependency stuff */
 
-/* node is guaranteed to be not checked before */
-static int node_get_deplist_recurs(NodeTree *ntree, Node *node, Node ***nsort)
-{
-  int level = 0xFFF;
+/* Dependencies of all nodes of a tree: the from-nodes of their incoming links, in links list
+ * order, followed by their parent. Stored as one flat array with per-node offsets, so that
+ * sorting never has to scan the links list again. */
+struct NodeDependencies {
+  Span<Node *> nodes;
+  const Map<const Node *, int> *node_indices;
+  Array<int> offsets;
+  Array<int> indices;
+};
 
-  node->done = true;
+static void node_dependencies_build(NodeTree *ntree, NodeDependencies &r_deps)
+{
+  const dune::NodeTreeTopology &topology = dune::node_tree_topology_ensure(*ntree);
+  r_deps.nodes = topology.nodes;
+  r_deps.node_indices = &topology.node_indices;
+  const int nodes_num = r_deps.nodes.size();
 
-  /* check linked nodes */
-  LIST_FOREACH (NodeLink *, link, &ntree->links) {
-    if (link->tonode == node) {
-      Node *fromnode = link->fromnode;
-      if (fromnode->done == 0) {
-        fromnode->level = node_get_deplist_recurs(ntree, fromnode, nsort);
-      }
-      if (fromnode->level <= level) {
-        level = fromnode->level - 1;
-      }
+  Array<int> counts(nodes_num, 0);
+  for (const int to_index : topology.link_to_nodes) {
+    counts[to_index]++;
+  }
+  for (const int i : r_deps.nodes.index_range()) {
+    if (r_deps.nodes[i]->parent) {
+      counts[i]++;
     }
   }
 
-  /* check parent node */
-  if (node->parent) {
-    if (node->parent->done == 0) {
-      node->parent->level = node_get_deplist_recurs(ntree, node->parent, nsort);
-    }
-    if (node->parent->level <= level) {
-      level = node->parent->level - 1;
+  r_deps.offsets.reinitialize(nodes_num + 1);
+  r_deps.offsets[0] = 0;
+  for (const int i : IndexRange(nodes_num)) {
+    r_deps.offsets[i + 1] = r_deps.offsets[i] + counts[i];
+  }
+
+  /* Fill from the start of each range, re-using counts as cursors. */
+  r_deps.indices.reinitialize(r_deps.offsets[nodes_num]);
+  for (const int i : IndexRange(nodes_num)) {
+    counts[i] = r_deps.offsets[i];
+  }
+  for (const int link_index : topology.links.index_range()) {
+    const int to_index = topology.link_to_nodes[link_index];
+    r_deps.indices[counts[to_index]++] = topology.link_from_nodes[link_index];
+  }
+  /* Parents are read from the nodes, they can change without changing the topology. */
+  for (const int i : IndexRange(nodes_num)) {
+    if (Node *parent = r_deps.nodes[i]->parent) {
+      r_deps.indices[counts[i]++] = topology.node_indices.lookup(parent);
     }
   }
+}
 
-  if (nsort) {
-    **nsort = node;
-    (*nsort)++;
+/* Depth-first sort of the nodes, dependencies first, setting `node->level` such that each node
+ * has a lower level than all nodes it depends on. When `nsort` is given, nodes are written to it
+ * in sorted order.
+ *
+ * This is an iterative version of a recursive search, visiting nodes and dependencies in the same
+ * order and giving the same levels, including for cycles: a dependency that is still being visited
+ * contributes its previous level.
+ *
+ * return true if there is a dependency cycle in the tree. */
+static bool node_deplist_sort(NodeTree *ntree, Node ***nsort)
+{
+  NodeDependencies deps;
+  node_dependencies_build(ntree, deps);
+
+  struct StackItem {
+    int node_index;
+    int dep_next;
+    int level;
+  };
+  Stack<StackItem> stack;
+  Array<bool> in_stack(deps.nodes.size(), false);
+  bool has_cycle = false;
+
+  /* Roots are visited in `NodeTree.nodes` order, which the topology does not follow once nodes
+   * are reordered. */
+  LIST_FOREACH (Node *, root, &ntree->nodes) {
+    if (root->done) {
+      continue;
+    }
+    const int root_index = deps.node_indices->lookup(root);
+    root->done = true;
+    in_stack[root_index] = true;
+    stack.push({root_index, deps.offsets[root_index], 0xFFF});
+
+    while (!stack.is_empty()) {
+      StackItem &item = stack.peek();
+      if (item.dep_next < deps.offsets[item.node_index + 1]) {
+        const int dep_index = deps.indices[item.dep_next++];
+        Node *dep_node = deps.nodes[dep_index];
+        if (!dep_node->done) {
+          dep_node->done = true;
+          in_stack[dep_index] = true;
+          stack.push({dep_index, deps.offsets[dep_index], 0xFFF});
+          continue;
+        }
+        if (in_stack[dep_index]) {
+          has_cycle = true;
+        }
+        if (dep_node->level <= item.level) {
+          item.level = dep_node->level - 1;
+        }
+        continue;
+      }
+
+      /* All dependencies done. */
+      Node *node = deps.nodes[item.node_index];
+      node->level = item.level;
+      in_stack[item.node_index] = false;
+      if (nsort) {
+        **nsort = node;
+        (*nsort)++;
+      }
+      stack.pop();
+      if (!stack.is_empty()) {
+        StackItem &user_item = stack.peek();
+        if (node->level <= user_item.level) {
+          user_item.level = node->level - 1;
+        }
+      }
+    }
   }
 
-  return level;
+  return has_cycle;
 }
 
 void ntreeGetDependencyList(struct NodeTree *ntree, struct Node ***r_deplist, int *r_deplist_len)
@@ -4266,30 +5492,171 @@ void ntreeGetDependencyList(struct NodeTree *ntree, struct Node ***r_deplist, in
   nsort = *r_deplist = (Node **)mem_callocn((*r_deplist_len) * sizeof(bNode *),
                                              "sorted node array");
 
-  /* recursive check */
-  LIST_FOREACH (Node *, node, &ntree->nodes) {
-    if (node->done == 0) {
-      node->level = node_get_deplist_recurs(ntree, node, &nsort);
-    }
+  const bool has_cycle = node_deplist_sort(ntree, &nsort);
+  if (has_cycle) {
+    CLOG_INFO(&LOG, 2, "dependency cycle in node tree %s", ntree->id.name + 2);
   }
+  dune::node_levels_set_updated(*ntree, has_cycle);
 }
 
 /* only updates node->level for detecting cycles links */
 void ntreeUpdateNodeLevels(NodeTree *ntree)
 {
+  /* Link additions and removals keep levels up to date, parent changes do not. */
+  if (dune::node_levels_are_valid(ntree) &&
+      ntree->runtime->levels_parents_hash == dune::node_levels_parents_hash(*ntree)) {
+    return;
+  }
+
   /* first clear tag */
   LIST_FOREACH (Node *, node, &ntree->nodes) {
     node->done = false;
   }
 
-  /* recursive check */
-  LIST_FOREACH (Node *, node, &ntree->nodes) {
-    if (node->done == 0) {
-      node->level = node_get_deplist_recurs(ntree, node, nullptr);
+  const bool has_cycle = node_deplist_sort(ntree, nullptr);
+  if (has_cycle) {
+    CLOG_INFO(&LOG, 2, "dependency cycle in node tree %s", ntree->id.name + 2);
+  }
+  dune::node_levels_set_updated(*ntree, has_cycle);
+}
+
+namespace dune {
+
+/* Everything needed during execution is copied from the topology, which callbacks changing the
+ * tree anyway (against the NodeExecFn requirements) would free. */
+struct NodeExecState {
+  NodeTree *ntree;
+  Array<Node *> nodes;
+  /* Nodes linked to the outputs of node i are `successors[successor_offsets[i]]` to
+   * `successors[successor_offsets[i + 1] - 1]`, once per link. */
+  Array<int> successor_offsets;
+  Array<int> successors;
+  /* Amount of links from nodes not executed yet, for each node. */
+  Array<uint> pending_num;
+
+  NodeExecFn exec_fn;
+  void *userdata;
+  bool use_timing;
+  MutableSpan<double> node_times;
+  uint executed_num;
+};
+
+static void node_exec_state_init(NodeExecState &state, const NodeTreeTopology &topology)
+{
+  const int nodes_num = topology.nodes.size();
+  state.nodes = Array<Node *>(topology.nodes.as_span());
+  state.pending_num.reinitialize(nodes_num);
+  state.pending_num.fill(0);
+
+  Array<int> counts(nodes_num, 0);
+  for (const int link_index : topology.links.index_range()) {
+    counts[topology.link_from_nodes[link_index]]++;
+    state.pending_num[topology.link_to_nodes[link_index]]++;
+  }
+
+  state.successor_offsets.reinitialize(nodes_num + 1);
+  state.successor_offsets[0] = 0;
+  for (const int i : IndexRange(nodes_num)) {
+    state.successor_offsets[i + 1] = state.successor_offsets[i] + counts[i];
+    counts[i] = state.successor_offsets[i];
+  }
+  state.successors.reinitialize(state.successor_offsets[nodes_num]);
+  for (const int link_index : topology.links.index_range()) {
+    state.successors[counts[topology.link_from_nodes[link_index]]++] =
+        topology.link_to_nodes[link_index];
+  }
+}
+
+static void node_exec_run(NodeExecState &state, const int node_index)
+{
+  const double start_time = state.use_timing ? lib_check_seconds_timer() : 0.0;
+  state.exec_fn(state.ntree, state.nodes[node_index], state.userdata);
+  if (state.use_timing) {
+    state.node_times[node_index] = lib_check_seconds_timer() - start_time;
+  }
+  atomic_add_and_fetch_u(&state.executed_num, 1);
+}
+
+static void node_exec_task(TaskPool *__restrict pool, void *taskdata)
+{
+  NodeExecState &state = *(NodeExecState *)lib_task_pool_user_data(pool);
+  const int node_index = int(PTR_AS_UINT(taskdata));
+
+  node_exec_run(state, node_index);
+
+  for (int i = state.successor_offsets[node_index]; i < state.successor_offsets[node_index + 1];
+       i++) {
+    const int successor = state.successors[i];
+    if (atomic_sub_and_fetch_u(&state.pending_num[successor], 1) == 0) {
+      lib_task_pool_push(pool, node_exec_task, PTR_FROM_UINT(uint(successor)), false, nullptr);
+    }
+  }
+}
+
+NodeTreeExecResult node_tree_execute(NodeTree &ntree,
+                                     NodeExecFn exec_fn,
+                                     void *userdata,
+                                     const NodeTreeExecSettings &settings)
+{
+  NodeExecState state;
+  state.ntree = &ntree;
+  state.exec_fn = exec_fn;
+  state.userdata = userdata;
+  state.use_timing = settings.use_timing;
+  state.executed_num = 0;
+  node_exec_state_init(state, node_tree_topology_ensure(ntree));
+  const int nodes_num = state.nodes.size();
+
+  NodeTreeExecResult result;
+  if (settings.use_timing) {
+    result.node_times.resize(nodes_num, 0.0);
+    state.node_times = result.node_times;
+  }
+
+  if (settings.use_single_thread) {
+    /* Same scheduling, with a first in first out queue of ready nodes seeded in tree order. */
+    Vector<int> queue;
+    for (const int i : IndexRange(nodes_num)) {
+      if (state.pending_num[i] == 0) {
+        queue.append(i);
+      }
+    }
+    for (int queue_index = 0; queue_index < queue.size(); queue_index++) {
+      const int node_index = queue[queue_index];
+      node_exec_run(state, node_index);
+      for (const int i : IndexRange(state.successor_offsets[node_index],
+                                    state.successor_offsets[node_index + 1] -
+                                        state.successor_offsets[node_index])) {
+        if (--state.pending_num[state.successors[i]] == 0) {
+          queue.append(state.successors[i]);
+        }
+      }
+    }
+  }
+  else {
+    TaskPool *pool = lib_task_pool_create(&state, TASK_PRIORITY_HIGH);
+    for (const int i : IndexRange(nodes_num)) {
+      if (state.pending_num[i] == 0) {
+        lib_task_pool_push(pool, node_exec_task, PTR_FROM_UINT(uint(i)), false, nullptr);
+      }
     }
+    lib_task_pool_work_and_wait(pool);
+    lib_task_pool_free(pool);
   }
+
+  result.executed_num = int(state.executed_num);
+  if (result.executed_num < nodes_num) {
+    CLOG_INFO(&LOG,
+              2,
+              "%d nodes of tree %s not executed because of dependency cycles",
+              nodes_num - result.executed_num,
+              ntree.id.name + 2);
+  }
+  return result;
 }
 
+}  // namespace dune
+
 void ntreeUpdateAllNew(Main *main)
 {
   Vector<bNodeTree *> new_ntrees;
@@ -5065,6 +6432,8 @@ void BKE_node_system_exit()
     lib_ghash_free(nodetreetypes_hash, nullptr, ntree_free_type);
     nodetreetypes_hash = nullptr;
   }
+
+  dune::node_preview_pool_free();
 }
 
 /* NodeTree Iter Helpers (FOREACH_NODETREE_BEGIN) */
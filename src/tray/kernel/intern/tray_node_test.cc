@@ -0,0 +1,466 @@
+#include "testing/testing.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+#include "mem_guardedalloc.h"
+
+#include "atomic_ops.h"
+
+#include "lib_list.h"
+#include "lib_map.hh"
+#include "lib_string.h"
+#include "lib_vector.hh"
+
+#include "types_node.h"
+
+#include "tray_idtype.h"
+#include "tray_node.h"
+#include "tray_node_runtime.hh"
+
+namespace dune::tests {
+
+/* Nodes of a test tree are created in order, and links always go from a node to a node created
+ * later, so the tree never has a cycle. */
+class NodeTreeCacheTest : public testing::Test {
+ public:
+  static void SetUpTestSuite()
+  {
+    idtype_init();
+    dune_node_system_init();
+  }
+
+  static void TearDownTestSuite()
+  {
+    BKE_node_system_exit();
+  }
+
+ protected:
+  NodeTree *ntree = nullptr;
+  tray::Vector<Node *> nodes;
+  std::mt19937 rng{1234};
+
+  void SetUp() override
+  {
+    ntree = ntreeAddTree(nullptr, "Test", "ShaderNodeTree");
+  }
+
+  void TearDown() override
+  {
+    ntreeFreeEmbeddedTree(ntree);
+    mem_freen(ntree);
+  }
+
+  Node *add_node()
+  {
+    /* Undefined node type, only the sockets added here. */
+    Node *node = nodeAddNode(nullptr, ntree, "TestNode");
+    nodeAddSocket(ntree, node, SOCK_IN, "NodeSocketFloat", "", "A");
+    nodeAddSocket(ntree, node, SOCK_IN, "NodeSocketFloat", "", "B");
+    nodeAddSocket(ntree, node, SOCK_OUT, "NodeSocketFloat", "", "A");
+    nodeAddSocket(ntree, node, SOCK_OUT, "NodeSocketFloat", "", "B");
+    nodes.append(node);
+    return node;
+  }
+
+  int random_int(const int max)
+  {
+    return std::uniform_int_distribution<int>(0, max - 1)(rng);
+  }
+
+  NodeLink *add_random_link()
+  {
+    const int nodes_num = int(nodes.size());
+    const int from = random_int(nodes_num - 1);
+    const int to = from + 1 + random_int(nodes_num - from - 1);
+    Node *from_node = nodes[from];
+    Node *to_node = nodes[to];
+    NodeSocket *from_sock = (NodeSocket *)lib_findlink(&from_node->outputs, random_int(2));
+    NodeSocket *to_sock = (NodeSocket *)lib_findlink(&to_node->inputs, random_int(2));
+    return nodeAddLink(ntree, from_node, from_sock, to_node, to_sock);
+  }
+
+  void remove_random_link()
+  {
+    const int links_num = lib_list_count(&ntree->links);
+    if (links_num > 0) {
+      nodeRemLink(ntree, (NodeLink *)lib_findlink(&ntree->links, random_int(links_num)));
+    }
+  }
+
+  void add_nodes_and_random_links(const int nodes_num, const int links_num)
+  {
+    for (int i = 0; i < nodes_num; i++) {
+      add_node();
+    }
+    for (int i = 0; i < links_num; i++) {
+      add_random_link();
+    }
+  }
+
+  /* Apply random link additions and removals, with more additions than removals. */
+  void random_link_changes(const int changes_num)
+  {
+    for (int i = 0; i < changes_num; i++) {
+      if (random_int(3) == 0) {
+        remove_random_link();
+      }
+      else {
+        add_random_link();
+      }
+    }
+  }
+};
+
+static tray::Vector<NodeLink *> sorted_links(tray::Span<NodeLink *> links)
+{
+  tray::Vector<NodeLink *> result(links);
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+TEST_F(NodeTreeCacheTest, levels_incremental)
+{
+  add_nodes_and_random_links(50, 80);
+  tray::Vector<Node *> frames;
+  for (int i = 0; i < 3; i++) {
+    frames.append(nodeAddNode(nullptr, ntree, "NodeFrame"));
+  }
+  ntreeUpdateNodeLevels(ntree);
+
+  for (int round = 0; round < 20; round++) {
+    /* Parent changes do not go through the tree, they must be detected on the next update. */
+    for (int i = 0; i < 5; i++) {
+      Node *node = nodes[random_int(int(nodes.size()))];
+      nodeDetachNode(node);
+      if (random_int(2) == 0) {
+        nodeAttachNode(node, frames[random_int(int(frames.size()))]);
+      }
+    }
+    random_link_changes(10);
+    /* The tree has no cycle, so incremental updates must have kept the levels valid. */
+    ASSERT_TRUE(ntree->runtime->levels_are_valid);
+    ntreeUpdateNodeLevels(ntree);
+
+    tray::Map<const Node *, int> incremental_levels;
+    for (const Node *node : nodes) {
+      incremental_levels.add_new(node, node->level);
+    }
+
+    node_tree_levels_tag_dirty(*ntree);
+    ntreeUpdateNodeLevels(ntree);
+    for (const Node *node : nodes) {
+      EXPECT_EQ(incremental_levels.lookup(node), node->level) << node->name;
+    }
+  }
+}
+
+TEST_F(NodeTreeCacheTest, links_index)
+{
+  add_nodes_and_random_links(30, 40);
+  /* Build the index, so that it is updated incrementally from now on. */
+  node_input_links(*ntree, *nodes[0]);
+  random_link_changes(100);
+  ASSERT_TRUE(ntree->runtime->links_index_is_valid);
+
+  for (const Node *node : nodes) {
+    tray::Vector<NodeLink *> input_links;
+    tray::Vector<NodeLink *> output_links;
+    LIST_FOREACH (NodeLink *, link, &ntree->links) {
+      if (link->tonode == node) {
+        input_links.append(link);
+      }
+      if (link->fromnode == node) {
+        output_links.append(link);
+      }
+    }
+    std::sort(input_links.begin(), input_links.end());
+    std::sort(output_links.begin(), output_links.end());
+    EXPECT_EQ(sorted_links(node_input_links(*ntree, *node)).as_span(), input_links.as_span());
+    EXPECT_EQ(sorted_links(node_output_links(*ntree, *node)).as_span(), output_links.as_span());
+
+    for (const List *sockets : {&node->inputs, &node->outputs}) {
+      LIST_FOREACH (const NodeSocket *, sock, sockets) {
+        tray::Vector<NodeLink *> socket_links;
+        LIST_FOREACH (NodeLink *, link, &ntree->links) {
+          if (link->fromsock == sock || link->tosock == sock) {
+            socket_links.append(link);
+          }
+        }
+        std::sort(socket_links.begin(), socket_links.end());
+        EXPECT_EQ(sorted_links(node_socket_links(*ntree, *sock)).as_span(),
+                  socket_links.as_span());
+      }
+    }
+  }
+}
+
+TEST_F(NodeTreeCacheTest, socket_owners)
+{
+  add_nodes_and_random_links(10, 0);
+  /* Build the map, then add nodes and sockets that must be registered incrementally. */
+  Node *r_node;
+  int r_index;
+  nodeFindNode(ntree, (NodeSocket *)nodes[0]->inputs.first, &r_node, &r_index);
+  add_nodes_and_random_links(10, 0);
+  for (Node *node : nodes) {
+    nodeAddSocket(ntree, node, SOCK_IN, "NodeSocketFloat", "", "C");
+  }
+  ASSERT_TRUE(ntree->runtime->socket_owners_is_valid);
+  EXPECT_TRUE(node_tree_socket_owners_validate(*ntree));
+
+  for (Node *node : nodes) {
+    for (List *sockets : {&node->inputs, &node->outputs}) {
+      int index = 0;
+      LIST_FOREACH (NodeSocket *, sock, sockets) {
+        ASSERT_TRUE(nodeFindNode(ntree, sock, &r_node, &r_index));
+        EXPECT_EQ(r_node, node);
+        EXPECT_EQ(r_index, index);
+        index++;
+      }
+    }
+  }
+
+  /* Removing a socket shifts the indices of the sockets after it. */
+  for (Node *node : nodes) {
+    nodeRemoveSocket(ntree, node, (NodeSocket *)node->inputs.first);
+  }
+  ASSERT_TRUE(ntree->runtime->socket_owners_is_valid);
+  EXPECT_TRUE(node_tree_socket_owners_validate(*ntree));
+  for (Node *node : nodes) {
+    int index = 0;
+    LIST_FOREACH (NodeSocket *, sock, &node->inputs) {
+      ASSERT_TRUE(nodeFindNode(ntree, sock, &r_node, &r_index));
+      EXPECT_EQ(r_node, node);
+      EXPECT_EQ(r_index, index);
+      index++;
+    }
+  }
+}
+
+TEST_F(NodeTreeCacheTest, find_by_name)
+{
+  add_nodes_and_random_links(20, 0);
+  for (Node *node : nodes) {
+    EXPECT_EQ(nodeFindNodebyName(ntree, node->name), node);
+  }
+
+  /* Renamed without nodeUniqueName, the map still has the old name. */
+  lib_strncpy(nodes[3]->name, "Renamed", sizeof(nodes[3]->name));
+  EXPECT_EQ(nodeFindNodebyName(ntree, "Renamed"), nodes[3]);
+
+  Node *removed_node = nodes[5];
+  char removed_name[sizeof(removed_node->name)];
+  lib_strncpy(removed_name, removed_node->name, sizeof(removed_name));
+  nodeRemoveNode(nullptr, ntree, removed_node, false);
+  nodes.remove(5);
+  EXPECT_EQ(nodeFindNodebyName(ntree, removed_name), nullptr);
+
+  Node *new_node = add_node();
+  EXPECT_EQ(nodeFindNodebyName(ntree, new_node->name), new_node);
+  for (Node *node : nodes) {
+    EXPECT_EQ(nodeFindNodebyName(ntree, node->name), node);
+  }
+}
+
+struct NodeExecOrderData {
+  tray::Map<const Node *, int> *order;
+  uint counter;
+};
+
+static void node_exec_order_record(NodeTree * /*ntree*/, Node *node, void *userdata)
+{
+  NodeExecOrderData *data = static_cast<NodeExecOrderData *>(userdata);
+  const uint order = atomic_add_and_fetch_u(&data->counter, 1);
+  /* Each node writes its own pre-allocated slot. */
+  data->order->lookup(node) = int(order);
+}
+
+TEST_F(NodeTreeCacheTest, execute_order)
+{
+  add_nodes_and_random_links(200, 400);
+
+  for (const bool use_single_thread : {true, false}) {
+    tray::Map<const Node *, int> order;
+    for (const Node *node : nodes) {
+      order.add_new(node, -1);
+    }
+    NodeExecOrderData data = {&order, 0};
+    NodeTreeExecSettings settings;
+    settings.use_single_thread = use_single_thread;
+    const NodeTreeExecResult result = node_tree_execute(
+        *ntree, node_exec_order_record, &data, settings);
+
+    EXPECT_EQ(result.executed_num, int(nodes.size()));
+    for (const Node *node : nodes) {
+      EXPECT_NE(order.lookup(node), -1) << node->name;
+    }
+    /* Same constraint as the levels of a full recompute: every node runs after all nodes
+     * linked to its inputs. */
+    LIST_FOREACH (const NodeLink *, link, &ntree->links) {
+      EXPECT_LT(order.lookup(link->fromnode), order.lookup(link->tonode));
+    }
+    node_tree_levels_tag_dirty(*ntree);
+    ntreeUpdateNodeLevels(ntree);
+    LIST_FOREACH (const NodeLink *, link, &ntree->links) {
+      EXPECT_GT(link->fromnode->level, link->tonode->level);
+    }
+  }
+}
+
+TEST_F(NodeTreeCacheTest, localize_copy_on_write)
+{
+  add_nodes_and_random_links(10, 10);
+  NodeTree *group = ntreeAddTree(nullptr, "Group", "ShaderNodeTree");
+  for (int i = 0; i < 5; i++) {
+    Node *node = nodeAddNode(nullptr, group, "TestNode");
+    nodeAddSocket(group, node, SOCK_IN, "NodeSocketFloat", "", "A");
+  }
+  Node *group_nodes[2];
+  for (Node *&group_node : group_nodes) {
+    group_node = nodeAddNode(nullptr, ntree, "ShaderNodeGroup");
+    group_node->id = &group->id;
+  }
+
+  /* Free one localized tree directly, and merge the other one back. */
+  for (const bool merge : {false, true}) {
+    NodeTree *ltree = node_tree_localize(ntree, true);
+    ASSERT_NE(ltree, nullptr);
+    EXPECT_TRUE(ltree->id.tag & LIB_TAG_LOCALIZED);
+
+    /* Both group nodes use the same local group, owned by the local tree. */
+    Node *local_group_nodes[2] = {nullptr, nullptr};
+    LIST_FOREACH (Node *, node, &ltree->nodes) {
+      for (int i = 0; i < 2; i++) {
+        if (node->original == group_nodes[i]) {
+          local_group_nodes[i] = node;
+        }
+      }
+    }
+    ASSERT_NE(local_group_nodes[0], nullptr);
+    ASSERT_NE(local_group_nodes[1], nullptr);
+    NodeTree *local_group = (NodeTree *)local_group_nodes[0]->id;
+    EXPECT_NE(local_group, group);
+    EXPECT_EQ(local_group_nodes[1]->id, &local_group->id);
+    EXPECT_EQ(ltree->runtime->local_group_trees.size(), 1);
+    EXPECT_EQ(lib_list_count(&local_group->nodes), 5);
+
+    /* Local nodes share socket values until they are owned. */
+    LIST_FOREACH (Node *, node, &ltree->nodes) {
+      const NodeSocket *orig_sock = (const NodeSocket *)node->original->inputs.first;
+      NodeSocket *sock = (NodeSocket *)node->inputs.first;
+      if (sock == nullptr) {
+        continue;
+      }
+      EXPECT_TRUE(node_local_is_shared(*ltree, *node));
+      EXPECT_EQ(sock->default_value, orig_sock->default_value);
+      node_local_ensure_owned(*ltree, *node);
+      EXPECT_FALSE(node_local_is_shared(*ltree, *node));
+      if (orig_sock->default_value) {
+        EXPECT_NE(sock->default_value, orig_sock->default_value);
+      }
+      break;
+    }
+
+    if (merge) {
+      ntreeLocalMerge(nullptr, ltree, ntree);
+    }
+    else {
+      ntreeFreeTree(ltree);
+      mem_freen(ltree);
+    }
+
+    /* The original trees keep their data. */
+    EXPECT_EQ(lib_list_count(&group->nodes), 5);
+    LIST_FOREACH (Node *, node, &group->nodes) {
+      EXPECT_NE(node->inputs.first, nullptr);
+    }
+  }
+
+  for (Node *group_node : group_nodes) {
+    group_node->id = nullptr;
+  }
+  ntreeFreeEmbeddedTree(group);
+  mem_freen(group);
+}
+
+struct NodeInstanceTestValue {
+  NodeInstanceHashEntry hash_entry;
+  int index;
+};
+
+static int node_instance_test_freed_num = 0;
+
+static void node_instance_test_value_free(void *value)
+{
+  node_instance_test_freed_num++;
+  mem_freen(value);
+}
+
+TEST(node_instance_hash, tag_and_remove_untagged)
+{
+  NodeInstanceHash *hash = node_instance_hash_new("test");
+  const int values_num = 1000;
+  tray::Vector<NodeInstanceKey> keys;
+  for (int i = 0; i < values_num; i++) {
+    const std::string name = "Node." + std::to_string(i);
+    NodeInstanceKey key = {5381};
+    for (const char c : name) {
+      key.value = ((key.value << 5) + key.value) ^ c;
+    }
+    keys.append(key);
+    NodeInstanceTestValue *value = mem_cnew<NodeInstanceTestValue>(__func__);
+    value->index = i;
+    node_instance_hash_insert(hash, key, value);
+  }
+  EXPECT_EQ(node_instance_hash_size(hash), values_num);
+
+  /* Tag every third value, half of them by key and half of them by value. */
+  node_instance_hash_clear_tags(hash);
+  for (int i = 0; i < values_num; i += 3) {
+    if (i % 2) {
+      EXPECT_TRUE(node_instance_hash_tag_key(hash, keys[i]));
+    }
+    else {
+      node_instance_hash_tag(hash, node_instance_hash_lookup(hash, keys[i]));
+    }
+  }
+  node_instance_test_freed_num = 0;
+  node_instance_hash_remove_untagged(hash, node_instance_test_value_free);
+  EXPECT_EQ(node_instance_test_freed_num, values_num - (values_num + 2) / 3);
+  EXPECT_EQ(node_instance_hash_size(hash), (values_num + 2) / 3);
+
+  for (int i = 0; i < values_num; i++) {
+    NodeInstanceTestValue *value = (NodeInstanceTestValue *)node_instance_hash_lookup(hash,
+                                                                                      keys[i]);
+    if (i % 3 == 0) {
+      ASSERT_NE(value, nullptr);
+      EXPECT_EQ(value->index, i);
+    }
+    else {
+      EXPECT_EQ(value, nullptr);
+    }
+  }
+
+  /* Inserting again reuses removed slots. */
+  for (int i = 1; i < values_num; i += 3) {
+    NodeInstanceTestValue *value = mem_cnew<NodeInstanceTestValue>(__func__);
+    value->index = i;
+    node_instance_hash_insert(hash, keys[i], value);
+  }
+  int iterated_num = 0;
+  NodeInstanceHashIter iter;
+  NODE_INSTANCE_HASH_ITER (iter, hash) {
+    const NodeInstanceTestValue *value = (const NodeInstanceTestValue *)
+        node_instance_hash_iter_get_value(&iter);
+    EXPECT_EQ(node_instance_hash_iter_get_key(&iter).value, keys[value->index].value);
+    EXPECT_NE(value->index % 3, 2);
+    iterated_num++;
+  }
+  EXPECT_EQ(iterated_num, node_instance_hash_size(hash));
+
+  node_instance_hash_free(hash, node_instance_test_value_free);
+}
+
+}  // namespace dune::tests
@@ -64,14 +64,20 @@ void libblock_runtime_reset_remapping_status(struct Id *id) ATTR_NONNULL(1);
 
 /* Generate a session-wise uuid for the given id.
  * note "session-wise" here means while editing a given .dune file. Once a new .dune file is
- * loaded or created, undo history is cleared/reset, and so is the uuid counter. */
+ * loaded or created, undo history is cleared/reset, and so is the uuid counter.
+ *
+ * note If the Id already is in a Main having a `Main.id_index`, call main_id_index_update_uuid
+ * afterwards. */
 void libblock_session_uuid_ensure(struct Id *id);
 /* Re-generate a new session-wise uuid for the given id.
  *
  * warning This has a few very specific use-cases, no other usage is expected currently:
  *   - To handle UI-related data-blocks that are kept across new file reading, when we do keep
  * existing UI.
- *   - For Ids that are made local without needing any copying. */
+ *   - For Ids that are made local without needing any copying.
+ *
+ * note If the Id's Main has a `Main.id_index`, callers must then update it with
+ * main_id_index_update_uuid. */
 void libblock_session_uuid_renew(struct Id *id);
 
 /* Generic helper to create a new empty data-block of given type in given main database.
@@ -123,6 +129,9 @@ enum {
 
   /* Keep the lib ptr when copying data-block outside of bmain. */
   ID_COPY_KEEP_LIB = 1 << 25,
+  /* Node trees: share node storage, properties and socket values with the source tree instead of
+   * copying them, see node_tree_localize. */
+  ID_COPY_NODETREE_SHARE_DATA = 1 << 26,
   /* EXCEPTION! Specific deep-copy of node trees used e.g. for rendering purposes. */
   ID_COPY_NODETREE_LOCALIZE = 1 << 27,
   /* EXCEPTION! Specific handling of RB objects regarding collections differs depending whether we
@@ -145,15 +154,21 @@ void libblock_copy_ex(struct Main *main,
 void *libblock_copy(struct Main *main, const struct Id *id) ATTR_WARN_UNUSED_RESULT
     ATTR_NONNULL();
 
-/* Sets the name of a block to name, suitably adjusted for uniqueness. */
+/* Sets the name of a block to name, suitably adjusted for uniqueness.
+ * note Callers having created a `Main.id_index` must update it, see main_id_index_rename_id. */
 void libblock_rename(struct Main *main, struct Id *id, const char *name) ATTR_NONNULL();
 /* Use after setting the Id's name
  * When name exists: call 'new_id' */
 void libblock_ensure_unique_name(struct Main *main, const char *name) ATTR_NONNULL();
 
+/* Find a local Id by type and name (without the two chars Id type prefix).
+ * See main_id_index_lookup_name for lookups that do not walk the Id list when many are needed. */
 struct Id *libblock_find_name(struct Main *main,
                               short type,
                               const char *name) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL();
+/* Find an Id by type and session uuid.
+ * note This walks the list of that type, see main_id_index_lookup_uuid for constant time lookups
+ * when many are needed. */
 struct Id *libblock_find_session_uuid(struct Main *main, short type, uint32_t session_uuid);
 /* Duplicate (a.k.a. deep copy) common processing options.
  * See also eDupFlags for options controlling what kind of Ids to duplicate. */
@@ -240,9 +255,12 @@ void id_delete(struct Main *main, void *idv) ATTR_NONNULL();
  * return Number of deleted datablocks. */
 size_t id_multi_tagged_delete(struct Main *main) ATTR_NONNULL();
 
-/* Add a 'NO_MAIN' data-block to given main (also sets usercounts of its Ids if needed). */
+/* Add a 'NO_MAIN' data-block to given main (also sets usercounts of its Ids if needed).
+ * note Callers having created a `Main.id_index` must then add it, see main_id_index_add_id. */
 void libblock_management_main_add(struct Main *main, void *idv);
-/* Remove a data-block from given main (set it to 'NO_MAIN' status). */
+/* Remove a data-block from given main (set it to 'NO_MAIN' status).
+ * note Callers having created a `Main.id_index` must first remove it from there, see
+ * main_id_index_remove_id. */
 void libblock_management_main_remove(struct Main *main, void *idv);
 
 void libblock_management_usercounts_set(struct Main *main, void *idv);
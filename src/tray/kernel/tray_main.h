@@ -27,10 +27,13 @@ struct lib_mempool;
 struct Thumbnail;
 struct GHash;
 struct GSet;
-struct IdNameLib_Map;
+struct Id;
+struct IdNameLibMap;
 struct ImBuf;
 struct Lib;
+struct MainIdUuidIndex;
 struct MainLock;
+struct MainThumbnailJob;
 struct UniqueName_Map;
 
 /* Tray thumbnail, as written to the `.tray` file (width, height, and data as char RGBA). */
@@ -65,11 +68,15 @@ typedef struct MainIdRelationsEntry {
   /* Session uuid of the Id matching that entry. */
   uint session_uuid;
 
-  /* Runtime tags, users should ensure those are reset after usage. */
-  uint tags;
+  /* Dense index of that entry in `MainIdRelations.entries`, also used to access its tags.
+   *
+   * note This replaces the former `tags` field: code reading or writing `entry->tags` must use
+   * `main_relations_index_tag_test/set(relations, entry->index, tag)` instead. */
+  uint index;
 } MainIdRelationsEntry;
 
-/* MainIdRelationsEntry.tags */
+/* Runtime tags of relation entries, see `main_relations_tag_` API.
+ * Users should ensure those are reset after usage. */
 typedef enum eMainIdRelationsEntryTags {
   /* Generic tag marking the entry as to be processed. */
   MAINIDRELATIONS_ENTRY_TAGS_DOIT = 1 << 0,
@@ -96,12 +103,74 @@ typedef enum eMainIdRelationsEntryTags {
                                           MAINIDRELATIONS_ENTRY_TAGS_INPROGRESS_FROM,
 } eMaindRelationsEntryTags;
 
+/* Amount of bits used by `eMainIdRelationsEntryTags`. */
+#define MAINIDRELATIONS_ENTRY_TAGS_BITS 10
+
+/* Index of an Id in `MainIdRelationsCompact`, for used Ids which are not part of the Main. */
+#define MAINIDRELATIONS_INDEX_NONE ((uint)-1)
+
+/* One relation between two Ids, in a `MainIdRelationsCompact` edges array. */
+typedef struct MainIdRelationsCompactEdge {
+  /* Dense index of the other Id of the relation (the user for `from` edges, the used Id for `to`
+   * edges). May be MAINIDRELATIONS_INDEX_NONE for `to` edges. */
+  uint id_index;
+  /* Session uuid of that other Id. */
+  uint session_uuid;
+  int usage_flag; /* Using IDWALK_ enums, defined in tray_lib_query.h */
+} MainIdRelationsCompactEdge;
+
+/* Compressed sparse row version of the relations, see MAINIDRELATIONS_COMPACT.
+ *
+ * Each Id of the Main gets a dense index. Edges of Id `i` are the contiguous ranges
+ * `[to_offsets[i], to_offsets[i + 1])` of `to_edges`, and `[from_offsets[i], from_offsets[i + 1])`
+ * of `from_edges`. There is no per-Id or per-edge allocation, and walking dependencies only reads
+ * a few flat arrays. */
+typedef struct MainIdRelationsCompact {
+  uint ids_num;
+  /* Ids by dense index. */
+  struct Id **ids;
+  /* Mapping from an Id ptr to its dense index. */
+  struct GHash *index_from_ptrs;
+  /* Session uuid of each Id. */
+  uint *session_uuids;
+
+  uint edges_num;
+  /* `ids_num + 1` offsets into `to_edges`/`to_id_ptrs`, and `from_edges`. */
+  uint *to_offsets;
+  uint *from_offsets;
+  MainIdRelationsCompactEdge *to_edges;
+  MainIdRelationsCompactEdge *from_edges;
+  /* Location of the ptr of each `to` edge in its user Id, kept apart as only remapping code
+   * needs it. */
+  struct Id ***to_id_ptrs;
+
+  /* Set when Ids were added, removed or remapped through the `main_relations_id_` API since
+   * these relations were generated. The arrays stay valid to read, but do not reflect those
+   * changes: removed Ids are NULL in `ids` (their edges must be skipped), added ones are missing.
+   * Call main_relations_create to re-generate them. */
+  bool is_outdated;
+} MainIdRelationsCompact;
+
 typedef struct MainIdRelations {
   /* Mapping from an Id ptr to all of its parents (Ids using it) and children (Ids it uses).
-   * Values are `MainIdRelationsEntry` ptrs. */
+   * Values are `MainIdRelationsEntry` ptrs.
+   * NULL when MAINIDRELATIONS_COMPACT is used. */
   struct GHash *relations_from_ptrs;
   /* NOTE: we could add more mappings when needed (e.g. from session uuid?). */
 
+  /* Only set when MAINIDRELATIONS_COMPACT is used. */
+  struct MainIdRelationsCompact *compact;
+
+  /* Entries by their dense `MainIdRelationsEntry.index` (NULL for compact relations, which use
+   * their own dense Id indices). */
+  struct MainIdRelationsEntry **entries;
+  /* Amount of dense indices, in both representations. */
+  uint entries_num;
+  uint entries_len_alloc;
+  /* One `LIB_bitmap` per bit of `eMainIdRelationsEntryTags`, indexed by dense index and
+   * `entries_len_alloc` bits long. Allocated on first use of that tag. */
+  uint *tags_bitmaps[MAINIDRELATIONS_ENTRY_TAGS_BITS];
+
   short flag;
 
   /* Private... */
@@ -111,6 +180,9 @@ typedef struct MainIdRelations {
 enum {
   /* Those main relations include ptrs/usages from editors. */
   MAINIDRELATIONS_INCLUDE_UI = 1 << 0,
+  /* Generate the compact (CSR) relations in `MainIdRelations.compact`, instead of the per-Id
+   * entries in `MainIdRelations.relations_from_ptrs`. */
+  MAINIDRELATIONS_COMPACT = 1 << 1,
 };
 
 typedef struct Main {
@@ -188,9 +260,19 @@ typedef struct Main {
    * know when, who and how it was created.
    * Used by code doing a lot of remapping etc. at once to speed things up. */
   struct MainIdRelations *relations;
+  /* Incremented each time `relations` are created, edited through the `main_relations_id_` API
+   * or freed, and never reset, so that code caching data derived from them can detect that it is
+   * outdated. */
+  uint relations_generation;
 
   /* IdMap of Ids. Currently used when reading (expanding) libs */
-  struct IdNameLib_Map *id_map;
+  struct IdNameLibMap *id_map;
+
+  /* Index of Ids by type and name, see `main_id_index_` API. Only exists between
+   * main_id_index_ensure and main_id_index_free calls of the code owning the Main. */
+  struct IdNameLibMap *id_index;
+  /* Index of Ids by session uuid, see main_id_index_lookup_uuid. Exists along with `id_index`. */
+  struct MainIdUuidIndex *id_uuid_index;
 
   /* Used for efficient calculations of unique names. */
   struct UniqueName_Map *name_map;
@@ -199,6 +281,9 @@ typedef struct Main {
    * linked data ones. */
   struct UniqueName_Map *name_map_global;
 
+  /* Pending thumbnail generation, see main_thumbnail_from_imbuf_async. */
+  struct MainThumbnailJob *thumb_job;
+
   struct MainLock *lock;
 } Main;
 
@@ -208,18 +293,178 @@ typedef struct Main {
 struct Main *main_new(void);
 void main_free(struct Main *mainvar);
 
+/* main_free_ex flags. */
+enum {
+  /* Free the Id lists of independent types from worker threads. */
+  MAIN_FREE_THREADED = 1 << 0,
+  /* Only free UI data-blocks and types bound to the main thread before returning, independent
+   * types are freed from a background thread, and the rest on a later call to main_free_ex or
+   * main_free_deferred_wait. Must be called from the main thread. */
+  MAIN_FREE_DEFERRED = 1 << 1,
+};
+/* Same as main_free, with optional threaded and/or deferred freeing of the Ids.
+ *
+ * UI types are freed first, then types whose freeing touches GPU or global state (objects,
+ * materials, node trees, images, sounds, fonts...) on the calling thread, then independent types
+ * (in parallel with MAIN_FREE_THREADED), and types referenced by others (libs, palettes, grease
+ * pencils...) last, on the calling thread. */
+void main_free_ex(struct Main *mainvar, int flag) ATTR_NONNULL();
+/* Wait until all Mains freed with MAIN_FREE_DEFERRED are actually freed, e.g. when memory must be
+ * reclaimed. Must be called from the main thread. */
+void main_free_deferred_wait(void);
+/* Free global data of the Main API (pending deferred Mains, thumbnail cache...). Call on exit
+ * from the main thread, after freeing G_MAIN. */
+void main_exit(void);
+
 /* Check whether given `main` is empty or contains some Ids */
 bool main_is_empty(struct Main *main);
 
+/* Locking of the Main database.
+ *
+ * The lock is a reader-writer lock, with one shard per Id type (indexed by `INDEX_ID_`):
+ * - main_lock gives exclusive access to the whole Main.
+ * - main_lock_read gives shared (read-only) access to the whole Main.
+ * - main_lock_type gives shared or exclusive access to the Ids of a single type, so that e.g. a
+ *   background indexer reading images does not wait on the UI editing objects.
+ *
+ * note Locks are not recursive, and a thread must not hold a type lock while taking another one,
+ * or a whole Main lock. */
 void main_lock(struct Main *main);
 void main_unlock(struct Main *main);
+void main_lock_read(struct Main *main);
+void main_unlock_read(struct Main *main);
+/* param write: Whether exclusive access to the Ids of `id_type` is needed. */
+void main_lock_type(struct Main *main, short id_type, bool write);
+void main_unlock_type(struct Main *main, short id_type);
+
+/* Instrumentation counters of a Main lock. */
+typedef struct MainLockStats {
+  /* Amount of times a lock (global or type shard) was acquired, in each mode. */
+  uint64_t read_acquired_num;
+  uint64_t write_acquired_num;
+  /* Amount of acquisitions which had to wait for another thread, estimated from the time spent
+   * waiting on the lock. */
+  uint64_t contended_num;
+  /* Total time spent waiting to acquire locks, in microseconds. */
+  uint64_t wait_time_us;
+  /* Total time spent holding exclusive (whole Main or type) locks, in microseconds. */
+  uint64_t write_hold_time_us;
+} MainLockStats;
+
+void main_lock_stats_get(const struct Main *main, MainLockStats *r_stats) ATTR_NONNULL();
+void main_lock_stats_reset(struct Main *main) ATTR_NONNULL();
+
+/* Id name index of a Main.
+ *
+ * Unlike the temporary maps from `main_idmap_create`, this one is stored in the Main, so that all
+ * code doing lookups in it benefits from it. It does not track changes by itself, it is meant for
+ * code doing many lookups in a Main it has exclusive access to (e.g. file reading, undo, or any
+ * code holding main_lock), which creates it with main_id_index_ensure and frees it with
+ * main_id_index_free once done. In between, that code must report the Ids it adds, removes or
+ * renames with main_id_index_add_id, main_id_index_remove_id and main_id_index_rename_id.
+ *
+ * Lookups never create or change the index, so they may run from several threads. Without an
+ * index, they walk the Id lists. Define USE_IDMAP_DEBUG_VALIDATE in `tray_main.c` to check the
+ * index against the Main on each lookup.
+ *
+ * It also indexes Ids by session uuid, see main_id_index_lookup_uuid. That part is kept up to
+ * date by the same add/remove calls, and by main_id_index_update_uuid, which that code must call
+ * when `libblock_session_uuid_ensure/renew` change the uuid of an Id already in the Main.
+ *
+ * note Code adding or removing Ids by directly editing the Main lists must free the index first.
+ * Freeing the Main frees it. */
+
+/* Create the index if needed. Needs exclusive access to the Main. */
+void main_id_index_ensure(struct Main *main) ATTR_NONNULL();
+/* Free the index, if any. Needs exclusive access to the Main. */
+void main_id_index_free(struct Main *main) ATTR_NONNULL();
+/* Add `id` to the index, if it exists. Must be called after the Id has been added to `main`. */
+void main_id_index_add_id(struct Main *main, struct Id *id) ATTR_NONNULL();
+/* Remove `id` from the index, if it exists.
+ * warning Must be called before the Id is removed from `main`. */
+void main_id_index_remove_id(struct Main *main, struct Id *id) ATTR_NONNULL();
+/* Update the index entry of `id`, if it exists, after its name changed from `old_name` (without
+ * the two chars Id type prefix). */
+void main_id_index_rename_id(struct Main *main, struct Id *id, const char *old_name)
+    ATTR_NONNULL();
+/* Update the uuid index entry of `id`, if it exists, after its session uuid changed from
+ * `old_uuid` (which may be MAIN_ID_SESSION_UUID_UNSET). */
+void main_id_index_update_uuid(struct Main *main, struct Id *id, uint old_uuid) ATTR_NONNULL();
+/* Find an Id by type, name (without the two chars Id type prefix) and lib. Walks the Id list of
+ * that type when there is no index. */
+struct Id *main_id_index_lookup_name(struct Main *main,
+                                     short type,
+                                     const char *name,
+                                     const struct Lib *lib) ATTR_WARN_UNUSED_RESULT
+    ATTR_NONNULL(1, 3);
+/* Find an Id by session uuid, in constant time when there is an index, walking all Ids
+ * otherwise. Returns NULL for MAIN_ID_SESSION_UUID_UNSET. */
+struct Id *main_id_index_lookup_uuid(struct Main *main, uint session_uuid) ATTR_WARN_UNUSED_RESULT
+    ATTR_NONNULL();
 
 /* Generate the mappings between used Ids and their users, and vice-versa. */
 void main_relations_create(struct Main *main, short flag);
 void main_relations_free(struct Main *main);
-/* Set or clear given `tag` in all relation entries of given `main` */
+/* Set or clear given `tag` in all relation entries of given `main`. This only touches the bitmaps
+ * of the tag bits, one word per `LIB_bitmap` worth of entries. */
 void main_relations_tag_set(struct Main *main, eMainIdRelationsEntryTags tag, bool value);
 
+/* Tags of a single relation entry, by dense index (`MainIdRelationsEntry.index`, or the
+ * compact relations index of an Id). When `tag` has several bits, test returns true if any of
+ * them is set. */
+bool main_relations_index_tag_test(const struct MainIdRelations *relations,
+                                   uint index,
+                                   eMainIdRelationsEntryTags tag) ATTR_WARN_UNUSED_RESULT
+    ATTR_NONNULL();
+void main_relations_index_tag_set(struct MainIdRelations *relations,
+                                  uint index,
+                                  eMainIdRelationsEntryTags tag,
+                                  bool value) ATTR_NONNULL();
+/* Find the first dense index starting at `index` which has any bit of `tag` set, scanning the
+ * tag bitmaps one word at a time. Returns MAINIDRELATIONS_INDEX_NONE if there are none left.
+ *
+ * Typical usage:
+ * `for (uint i = main_relations_tag_find_next(rel, tag, 0); i != MAINIDRELATIONS_INDEX_NONE;
+ *      i = main_relations_tag_find_next(rel, tag, i + 1))` */
+uint main_relations_tag_find_next(const struct MainIdRelations *relations,
+                                  eMainIdRelationsEntryTags tag,
+                                  uint index) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL();
+
+/* Incremental updates of existing (non-compact) relations, which are then kept valid without
+ * re-generating them. All of these are no-ops when `main` has no relations, and bump
+ * `Main.relations_generation` otherwise. Compact relations cannot be updated, they are kept but
+ * flagged as outdated instead, see `MainIdRelationsCompact.is_outdated`. */
+
+/* Add the relations of `id`, which has just been added to `main`. */
+void main_relations_id_add(struct Main *main, struct Id *id) ATTR_NONNULL();
+/* Remove all relations of `id`, which is about to be removed from `main`. Ids using it keep their
+ * ptrs to it, but these are not part of the relations anymore. */
+void main_relations_id_remove(struct Main *main, struct Id *id) ATTR_NONNULL();
+/* Update the relations after the Id ptr `*id_ptr` of `id_self` was changed from `old_id`
+ * (either of them may be NULL).
+ * param cb_flag: The IDWALK_CB_ usage flags of that ptr, as given by lib_foreach_id_link. */
+void main_relations_id_remap(struct Main *main,
+                             struct Id *id_self,
+                             struct Id **id_ptr,
+                             struct Id *old_id,
+                             int cb_flag) ATTR_NONNULL(1, 2, 3);
+/* Current generation of the relations of `main`, see `Main.relations_generation`. */
+uint main_relations_generation_get(const struct Main *main) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL();
+
+/* Dense index of `id` in compact relations, MAINIDRELATIONS_INDEX_NONE if not found. */
+uint main_relations_compact_index(const struct MainIdRelationsCompact *relations,
+                                  const struct Id *id) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL();
+/* Get the Ids used by the Id of given dense `index`, returns the amount of edges.
+ * param r_id_ptrs: Optional, location of the ptr of each edge in the user Id. */
+uint main_relations_compact_to_ids(const struct MainIdRelationsCompact *relations,
+                                   uint index,
+                                   const MainIdRelationsCompactEdge **r_edges,
+                                   struct Id ****r_id_ptrs) ATTR_NONNULL(1, 3);
+/* Get the Ids using the Id of given dense `index`, returns the amount of edges. */
+uint main_relations_compact_from_ids(const struct MainIdRelationsCompact *relations,
+                                     uint index,
+                                     const MainIdRelationsCompactEdge **r_edges) ATTR_NONNULL();
+
 /* Create a Set storing all Ids present in given main, by their ptrs.
  * param gset: If not NULL, given GSet will be extended with Ids from given main,
  * instead of creating a new one. */
@@ -227,13 +472,39 @@ struct GSet *main_gset_create(struct Main *main, struct GSet *gset);
 
 /* Temporary runtime API to allow re-using local (already appended)
  * Ids instead of appending a new copy again. */
+
+/* Opaque mapping between weak lib refs and local Ids, see main_lib_weak_ref_create. */
+typedef struct LibWeakRefMapping LibWeakRefMapping;
+
+/* Invalid handle of an interned string of a LibWeakRefMapping. */
+#define LIB_WEAK_REF_HANDLE_NONE ((uint)-1)
+
 /* Generate a mapping between 'lib path' of an Id
  * (as a pair (relative tray file path, id name)), and a current local Id, if any.
  * This uses the infor stored in `Id.lib_weak_ref` */
-struct GHash *main_lib_weak_ref_create(struct Main *main) ATTR_NONNULL();
+LibWeakRefMapping *main_lib_weak_ref_create(struct Main *main) ATTR_NONNULL();
 /* Destroy the data generated by main_lib_weak_ref_create. */
-void main_lib_weak_ref_destroy(struct GHash *lib_weak_ref_mapping)
+void main_lib_weak_ref_destroy(LibWeakRefMapping *lib_weak_ref_mapping)
     ATTR_NONNULL();
+
+/* Lib file paths and Id names are interned in the mapping, and can be referred to by integer
+ * handles. Code looking up many Ids from the same lib should get the handle of its path once,
+ * and use main_lib_weak_ref_search_item_handles.
+ *
+ * `str_maxncpy` is the size of the weak ref buffer the string is stored in (FILE_MAX for lib file
+ * paths, MAX_ID_NAME for Id names), longer strings are truncated the same way.
+ *
+ * Return the handle of `str`, interning it if needed. Handles stay valid until the mapping is
+ * destroyed. */
+uint main_lib_weak_ref_string_ensure(LibWeakRefMapping *lib_weak_ref_mapping,
+                                     const char *str,
+                                     size_t str_maxncpy) ATTR_NONNULL();
+/* Return the handle of `str`, or LIB_WEAK_REF_HANDLE_NONE if it is not interned (in which case
+ * no item of the mapping can use it). */
+uint main_lib_weak_ref_string_find(const LibWeakRefMapping *lib_weak_ref_mapping,
+                                   const char *str,
+                                   size_t str_maxncpy) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL();
+
 /* Search for a local Id matching the given linked Id ref.
  * param lib_weak_ref_mapping: the mapping data generated by
  * tray_main_lib_weak_ref_create.
@@ -241,16 +512,20 @@ void main_lib_weak_ref_destroy(struct GHash *lib_weak_ref_mapping)
  * param lib_id_name: the full Id name, including the leading two chars encoding the Id
  * type */
 struct Id *main_lib_weak_ref_search_item(
-            struct GHash *lib_weak_ref_mapping,
+            LibWeakRefMapping *lib_weak_ref_mapping,
             const char *lib_filepath,
             const char *lib_id_name) ATTR_NONNULL();
+/* Same as main_lib_weak_ref_search_item, using string handles. */
+struct Id *main_lib_weak_ref_search_item_handles(const LibWeakRefMapping *lib_weak_ref_mapping,
+                                                 uint lib_filepath,
+                                                 uint lib_id_name) ATTR_NONNULL();
 /* Add the given Id weak lib ref to given local Id and the runtime mapping.
  * param lib_weak_ref_mapping: the mapping data generated by
  * tray_main_lib_weak_ref_create.
  * param lib_filepath: the path of a tray file lib (relative to current working one).
  * param lib_id_name: the full Id name, including the leading two chars encoding the Id type.
  * param new_id: New local Id matching given weak ref. */
-void main_lib_weak_ref_add_item(struct GHash *lib_weak_ref_mapping,
+void main_lib_weak_ref_add_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                 const char *lib_filepath,
                                 const char *lib_id_name,
                                 struct Id *new_id) ATTR_NONNULL();
@@ -265,7 +540,7 @@ void main_lib_weak_ref_add_item(struct GHash *lib_weak_ref_mapping,
  * param lib_id_name: the full Id name, including the leading two chars encoding the Id type.
  * param old_id: Existing local Id matching given weak ref.
  * param new_id: New local Id matching given weak ref. */
-void main_lib_weak_ref_update_item(struct GHash *lib_weak_ref_mapping,
+void main_lib_weak_ref_update_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                    const char *lib_filepath,
                                    const char *lib_id_name,
                                    struct Id *old_id,
@@ -276,7 +551,7 @@ void main_lib_weak_ref_update_item(struct GHash *lib_weak_ref_mapping,
  * param lib_filepath: the path of a tray file lib (relative to current working one).
  * param lib_id_name: the full Id name, including the leading two chars encoding the Id type.
  * param old_id: Existing local Id matching given weak ref. */
-void main_lib_weak_ref_remove_item(struct GHash *lib_weak_ref_mapping,
+void main_lib_weak_ref_remove_item(LibWeakRefMapping *lib_weak_ref_mapping,
                                    const char *lib_filepath,
                                    const char *lib_id_name,
                                    struct Id *old_id) ATTR_NONNULL();
@@ -326,10 +601,21 @@ void main_lib_weak_ref_remove_item(struct GHash *lib_weak_ref_mapping,
   ((void)0)
 
 /* Generates a raw .tray file thumbnail data from given image.
+ * Images larger than THUMB_SIZE are downscaled (keeping their aspect ratio) with a box filter.
+ * The last generated thumbnail is cached with the size and an MD5 digest of the image pixels.
+ * Generating it again from an unchanged image hashes the pixels and copies the cached thumbnail,
+ * instead of downscaling again.
  * param bmain: If not NULL, also store generated data in this Main.
  * param img: ImBuf image to generate thumbnail data from.
  * return The generated .tray file raw thumbnail data. */
 struct Thumbnail *main_thumbnail_from_imbuf(struct Main *main, struct ImBuf *img);
+/* Same as main_thumbnail_from_imbuf, generating the thumbnail of `main` from a background
+ * thread. Takes ownership of `img`. Any previous pending generation is finished first.
+ * The result is only stored in `main` by main_thumbnail_wait. */
+void main_thumbnail_from_imbuf_async(struct Main *main, struct ImBuf *img) ATTR_NONNULL(1, 2);
+/* Wait for the pending thumbnail generation of `main` if any, and store its result in
+ * `main->tray_thumb`. */
+void main_thumbnail_wait(struct Main *main) ATTR_NONNULL();
 /* Generates an image from raw .tray file thumbnail data.
  * param main: Use this main->tray_thumb data if given data is NULL.
  * param data: Raw .tray file thumbnail data.
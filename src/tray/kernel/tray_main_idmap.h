@@ -0,0 +1,67 @@
+#pragma once
+
+/* Util fns for faster Id lookups in a Main database, see `tray_idmap.c`. */
+
+#include "lib_compiler_attrs.h"
+#include "lib_sys_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct Id;
+struct IdNameLibMap;
+struct Lib;
+struct Main;
+
+enum {
+  MAIN_IDMAP_TYPE_NAME = 1 << 0,
+  MAIN_IDMAP_TYPE_UUID = 1 << 1,
+};
+
+/* Generate mapping from Id type/name to Id ptr for given `main`.
+ *
+ * note When used during undo/redo, there is no guaranty that Id ptrs from UI area are not
+ * pointing to freed memory (when some Ids have been deleted). To avoid crashes in those cases, one
+ * can provide the 'old' (aka current) Main database as reference. main_idmap_lookup_id will
+ * then check that given Id does exist in `old_main` before trying to use it.
+ *
+ * param create_valid_ids_set: If true, generate a ref to prevent freed memory accesses.
+ * param old_main: If not NULL, its Ids will be added the valid refs set. */
+struct IdNameLibMap *main_idmap_create(struct Main *main,
+                                       bool create_valid_ids_set,
+                                       struct Main *old_main,
+                                       int idmap_types) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL(1);
+void main_idmap_destroy(struct IdNameLibMap *id_map) ATTR_NONNULL();
+
+void main_idmap_insert_id(struct IdNameLibMap *id_map, struct Id *id) ATTR_NONNULL();
+void main_idmap_remove_id(struct IdNameLibMap *id_map, struct Id *id) ATTR_NONNULL();
+/* Update the name mapping of `id`, which has just been renamed from `old_name` (without the
+ * Id code prefix). */
+void main_idmap_rename_id(struct IdNameLibMap *id_map, struct Id *id, const char *old_name)
+    ATTR_NONNULL();
+
+/* Build the name mappings of all Id types now instead of on their first lookup, so that name
+ * lookups never change the map afterwards (e.g. for maps read from several threads). */
+void main_idmap_name_maps_ensure(struct IdNameLibMap *id_map) ATTR_NONNULL();
+
+/* Check that all mappings match the current content of the Main, reporting mismatches.
+ * Meant for debugging only, this is as expensive as re-creating the map. */
+bool main_idmap_validate(struct IdNameLibMap *id_map) ATTR_NONNULL();
+
+struct Main *main_idmap_main_get(struct IdNameLibMap *id_map) ATTR_WARN_UNUSED_RESULT
+    ATTR_NONNULL();
+
+struct Id *main_idmap_lookup_name(struct IdNameLibMap *id_map,
+                                  short id_type,
+                                  const char *name,
+                                  const struct Lib *lib) ATTR_WARN_UNUSED_RESULT
+    ATTR_NONNULL(1, 3);
+struct Id *main_idmap_lookup_id(struct IdNameLibMap *id_map,
+                                const struct Id *id) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL(1, 2);
+struct Id *main_idmap_lookup_uuid(struct IdNameLibMap *id_map,
+                                  uint session_uuid) ATTR_WARN_UNUSED_RESULT ATTR_NONNULL(1);
+
+#ifdef __cplusplus
+}
+#endif
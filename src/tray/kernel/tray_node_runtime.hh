@@ -0,0 +1,206 @@
+#pragma once
+
+/* Runtime-only data of node trees, stored in `NodeTree.runtime`.
+ *
+ * The runtime is created on demand and never written to files. Copying or reading a tree leaves
+ * it unset, freeing the tree deletes it.
+ *
+ * The caches below are built lazily by const functions, which may be called from multiple
+ * threads reading the same tree (e.g. node execution callbacks). Changing the tree, and thereby
+ * updating or invalidating the caches, must not happen while other threads read it. */
+
+#include <memory>
+#include <mutex>
+
+#include "lib_index_range.hh"
+#include "lib_map.hh"
+#include "lib_set.hh"
+#include "lib_span.hh"
+#include "lib_utility_mixins.hh"
+#include "lib_vector.hh"
+
+#include "types_node.h"
+
+namespace dune {
+
+/* Node owning a socket, and index of the socket in the node inputs or outputs. */
+struct NodeSocketOwner {
+  Node *node;
+  int index;
+};
+
+/* Packed copy of the topology of a node tree: nodes, sockets and links in flat arrays, referring
+ * to each other by index. Meant for algorithms going over the whole tree, which would otherwise
+ * chase list pointers all over the heap. See node_tree_topology_ensure.
+ *
+ * note Only the topology is stored, node and link flags and other data that change without
+ * changing the topology must still be read from the nodes and links themselves. */
+struct NodeTreeTopology {
+  /* Nodes, in no guaranteed order: they are in `NodeTree.nodes` order when the topology is built,
+   * but reordering nodes (e.g. sorting them by selection for drawing) does not invalidate it. */
+  tray::Vector<Node *> nodes;
+  tray::Vector<short> node_types;
+  tray::Map<const Node *, int> node_indices;
+
+  /* Input sockets of all nodes, the inputs of node i are `input_sockets[input_offsets[i]]` to
+   * `input_sockets[input_offsets[i + 1] - 1]`. Same for outputs. */
+  tray::Vector<NodeSocket *> input_sockets;
+  tray::Vector<int> input_offsets;
+  tray::Vector<NodeSocket *> output_sockets;
+  tray::Vector<int> output_offsets;
+
+  /* Links, in `NodeTree.links` order, with their end points as node indices and indices in
+   * `output_sockets` and `input_sockets`. */
+  tray::Vector<NodeLink *> links;
+  tray::Vector<int> link_from_nodes;
+  tray::Vector<int> link_to_nodes;
+  tray::Vector<int> link_from_sockets;
+  tray::Vector<int> link_to_sockets;
+
+  tray::IndexRange node_inputs(const int node_index) const
+  {
+    return tray::IndexRange(input_offsets[node_index],
+                            input_offsets[node_index + 1] - input_offsets[node_index]);
+  }
+  tray::IndexRange node_outputs(const int node_index) const
+  {
+    return tray::IndexRange(output_offsets[node_index],
+                            output_offsets[node_index + 1] - output_offsets[node_index]);
+  }
+};
+
+class NodeTreeRuntime : tray::NonCopyable, tray::NonMovable {
+ public:
+  /* Protects the lazy building of the links index, the socket owners map, the nodes by name map
+   * and the topology. */
+  std::mutex cache_mutex;
+
+  /* Links connected to each socket, and the input and output links of each node.
+   *
+   * Built on first use, then kept up to date by nodeAddLink, nodeRemLink and socket and node
+   * removal. Code editing `NodeTree.links` directly, or changing the sockets of existing links,
+   * must call node_tree_links_index_tag_dirty afterwards. */
+  bool links_index_is_valid = false;
+  tray::Map<const NodeSocket *, tray::Vector<NodeLink *>> links_by_socket;
+  tray::Map<const Node *, tray::Vector<NodeLink *>> input_links_by_node;
+  tray::Map<const Node *, tray::Vector<NodeLink *>> output_links_by_node;
+
+  /* Owner of each node socket, see nodeFindNode.
+   *
+   * Built on first use, then kept up to date when sockets are created by nodeAddSocket, copied
+   * with their node, or removed. Code moving or reordering sockets directly must call
+   * node_tree_socket_owners_tag_dirty afterwards. */
+  bool socket_owners_is_valid = false;
+  tray::Map<const NodeSocket *, NodeSocketOwner> socket_owners;
+
+  /* Nodes by name, see nodeFindNodebyName. Built on first use, then invalidated when nodes are
+   * added, copied, freed or renamed with nodeUniqueName. Names set directly are handled by the
+   * lookup, which checks the name of the found node and walks the nodes on a mismatch or miss. */
+  bool nodes_by_name_is_valid = false;
+  tray::Map<tray::StringRef, Node *> nodes_by_name;
+
+  /* Built on first use, then freed by any topology change done through the node API. Code
+   * adding or removing nodes or links, or adding, removing or reordering sockets directly, must
+   * call node_tree_topology_tag_dirty afterwards. */
+  std::unique_ptr<NodeTreeTopology> topology;
+
+  /* Whether `Node.level` of all nodes is up to date and the tree has no cycle. Set by full level
+   * updates, then kept valid by nodeAddLink and nodeRemLink, which only update the levels of
+   * the nodes downstream of the link. Any other topology change invalidates the levels, as well
+   * as node_tree_topology_tag_dirty. Parent changes are detected by ntreeUpdateNodeLevels, which
+   * compares the parents of the nodes against `levels_parents_hash`. */
+  bool levels_are_valid = false;
+  /* Hash of all node and parent pairs, when the levels were last fully updated. */
+  uint64_t levels_parents_hash = 0;
+
+  /* Localized trees only, see node_tree_localize. Nodes still sharing their storage, properties
+   * and socket values with their original node. */
+  tray::Set<const Node *> shared_nodes;
+  /* Set on trees localized with copy-on-write, whose group trees are shared by all group nodes
+   * using them. Otherwise each group node owns its group tree. */
+  bool local_groups_are_shared = false;
+  /* Group trees localized along with this tree with copy-on-write, owned by it. Only set on the
+   * top-most localized tree. */
+  tray::Vector<NodeTree *> local_group_trees;
+};
+
+/* Get the runtime of the tree, creating it if needed. */
+NodeTreeRuntime &node_tree_runtime_ensure(NodeTree &ntree);
+void node_tree_runtime_free(NodeTree &ntree);
+
+/* Invalidate the links index, it will be rebuilt on next use. */
+void node_tree_links_index_tag_dirty(NodeTree &ntree);
+/* All links connected to `socket`, in no particular order. */
+tray::Span<NodeLink *> node_socket_links(const NodeTree &ntree, const NodeSocket &socket);
+tray::Span<NodeLink *> node_input_links(const NodeTree &ntree, const Node &node);
+tray::Span<NodeLink *> node_output_links(const NodeTree &ntree, const Node &node);
+
+/* Invalidate the socket owners map, it will be rebuilt on next use. */
+void node_tree_socket_owners_tag_dirty(NodeTree &ntree);
+/* Check the socket owners map against the node socket lists, reporting mismatches.
+ * Meant for debugging only, this is as expensive as re-building the map. */
+bool node_tree_socket_owners_validate(const NodeTree &ntree);
+
+/* Get the packed topology of the tree, building it if needed. */
+const NodeTreeTopology &node_tree_topology_ensure(const NodeTree &ntree);
+/* Also invalidates node levels. */
+void node_tree_topology_tag_dirty(NodeTree &ntree);
+/* Force the next ntreeUpdateNodeLevels to recompute the levels of the whole tree. */
+void node_tree_levels_tag_dirty(NodeTree &ntree);
+
+/* Execution of all nodes of a tree, each node only after all nodes linked to its inputs.
+ *
+ * Nodes become ready when the counter of their unfinished upstream nodes reaches zero, ready
+ * nodes are executed as tasks of a task pool, so independent branches run in parallel. */
+/* Called once for each node. It may read the tree (including the links index and other caches)
+ * and change the data of its node, but must not change the tree topology: adding or removing
+ * nodes, sockets or links is not supported during execution. */
+using NodeExecFn = void (*)(NodeTree *ntree, Node *node, void *userdata);
+
+struct NodeTreeExecSettings {
+  /* Execute all nodes on the calling thread, always in the same order, e.g. for debugging. */
+  bool use_single_thread = false;
+  /* Measure the execution time of each node, see NodeTreeExecResult.node_times. */
+  bool use_timing = false;
+};
+
+struct NodeTreeExecResult {
+  /* Amount of executed nodes, nodes that are part of a cycle or depend on one are skipped. */
+  int executed_num = 0;
+  /* Execution time of each node in seconds, in NodeTreeTopology.nodes order, when timing is
+   * enabled. Skipped nodes have a zero time. */
+  tray::Vector<double> node_times;
+};
+
+/* Call `exec_fn` for each node of the tree in dependency order.
+ * note `exec_fn` is called from multiple threads at the same time, unless single thread
+ * execution is requested. */
+NodeTreeExecResult node_tree_execute(NodeTree &ntree,
+                                     NodeExecFn exec_fn,
+                                     void *userdata,
+                                     const NodeTreeExecSettings &settings);
+
+/* Copy of the tree outside of Main for evaluation, tagged LIB_TAG_LOCALIZED, see ntreeLocalize.
+ *
+ * With `copy_on_write`, nodes share their storage, properties and socket values with their
+ * original node instead of duplicating them, until node_local_ensure_owned is called. Each group
+ * tree is localized once, and shared by all group nodes using it. Until then the original tree
+ * must not be changed or freed, and code changing the storage, properties or socket values of
+ * local nodes, tree type localize callbacks included, must call node_local_ensure_owned first.
+ * ntreeLocalize uses this mode. Without `copy_on_write`, it is a full copy, each group node
+ * getting its own group tree. */
+NodeTree *node_tree_localize(NodeTree *ntree, bool copy_on_write);
+bool node_local_is_shared(const NodeTree &ltree, const Node &node);
+/* Give the node its own copy of data shared with its original node, if any. */
+void node_local_ensure_owned(NodeTree &ltree, Node &node);
+
+/* Memory budget of all node preview rects, in bytes. When rects go over it, the rects of the
+ * least recently drawn previews of the tree whose previews are initialized or cleaned up are
+ * released, to be allocated again when drawn into. */
+void node_preview_pool_budget_set(size_t budget);
+/* Total size of the preview rects currently in use. */
+size_t node_preview_pool_used_size();
+/* Give back the memory of released preview rects kept for re-use. */
+void node_preview_pool_free();
+
+}  // namespace dune